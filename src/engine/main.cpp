@@ -1,23 +1,128 @@
 //std
 #include <cstdarg> // std::va_list, va_start, va_end
-#include <cstdlib> // std::exit
-#include <cstdio> // std::fprintf, std::vfprintf, std::fopen, std::ftell, std::fseek, std::fclose, stderr
-#include <cstring> // std::memcpy
+#include <cstdlib> // std::exit, std::strtod, std::strtoul
+#include <cstdio> // std::fprintf, std::vfprintf, std::fopen, std::fclose, std::fread, std::fwrite, std::fscanf, std::snprintf, std::rename, std::remove, stderr
+#include <cstring> // std::memcpy, std::memcmp, std::memset, std::strlen, std::strchr
+#include <cctype> // std::isspace
 #include <string> // std::string
 #include <vector> // std::vector
+#include <array> // std::array
 #include <tuple> // std::make_tuple, std::tie
-#include <iostream> // std::cin
+#include <iostream> // std::cin, std::ios
 #include <map> // std::map
+#include <set> // std::set
+#include <list> // std::list
 #include <chrono> // std::chrono
+#include <thread> // std::thread
+#include <mutex> // std::mutex, std::unique_lock
+#include <condition_variable> // std::condition_variable
+#include <deque> // std::deque
+#include <functional> // std::function
+#include <algorithm> // std::min, std::max
+#include <atomic> // std::atomic
+#include <cmath> // std::sqrt, std::tan, std::abs, std::pow, std::floor, std::isfinite, M_PI
+#include <limits> // std::numeric_limits
+#include <memory> // std::shared_ptr, std::make_shared
+#include <cerrno> // errno, EINTR, EAGAIN
+
+//posix
+#include <fcntl.h> // open, O_RDONLY
+#include <poll.h> // poll, pollfd, POLLIN
+#include <sys/mman.h> // mmap, munmap, madvise, MAP_SHARED, MAP_POPULATE, MAP_FAILED
+#include <sys/stat.h> // stat, fstat, struct stat
+#include <sys/syscall.h> // __NR_io_uring_setup, __NR_io_uring_enter
+#include <unistd.h> // close, pread, syscall
+
+//linux
+#include <linux/io_uring.h> // io_uring_params, io_uring_sqe, io_uring_cqe, IORING_OP_READ
+
+//zlib
+#include <zlib.h>
 
 //ospray
 #include <ospray/ospray.h>
 #include <ospray/ospray_util.h>
 
+// Bytes held by loaded volumes, frame buffers and encode buffers. Volumes
+// are counted from when their load is requested, and the least recently
+// rendered ones are unloaded to keep the total under --memory-limit.
+static struct {
+    std::atomic<size_t> volumeBytes{0};
+    std::atomic<size_t> frameBufferBytes{0};
+    std::atomic<size_t> encodeBytes{0};
+    size_t renders{0};  // clock for least recently rendered, main thread only
+} gMemory;
+
+static size_t xMemoryInUse() {
+    return gMemory.volumeBytes + gMemory.frameBufferBytes + gMemory.encodeBytes;
+}
+
+// Heap allocations made while encoding frames, stb's own included. Once
+// every resolution and encoding in use has been seen, this stops growing.
+static struct {
+    std::atomic<size_t> allocations{0};
+    size_t frames{0};
+    size_t framesAllocating{0};
+} gEncodeStats;
+
+static void *xCountedRealloc(void *data, size_t size) {
+    gEncodeStats.allocations++;
+    return std::realloc(data, size);
+}
+
+template <typename T>
+static void xResize(std::vector<T> &v, size_t size) {
+    size_t capacity = v.capacity();
+    if (size > capacity) gEncodeStats.allocations++;
+    v.resize(size);
+    gMemory.encodeBytes += (v.capacity() - capacity) * sizeof(T);
+}
+
 //stb
+#define STBIW_MALLOC(size) xCountedRealloc(nullptr, size)
+#define STBIW_REALLOC(data, size) xCountedRealloc(data, size)
+#define STBIW_FREE(data) std::free(data)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
+static struct {
+    std::string loadMode{"read"};
+    bool mmapPopulate{false};
+    std::string mmapAdvice{"normal"};
+    int ioThreads{4};
+    std::string readEngine{"uring"};  // for --load read: uring, falling back to threads, or threads
+    int readDepth{32};  // reads in flight per file
+    size_t readChunk{4UL << 20};  // bytes per read, a multiple of the page size
+    std::string protocol{"text"};
+    bool pipeline{false};
+    int pipelineDepth{2};
+    int threads{static_cast<int>(std::thread::hardware_concurrency())};
+    std::string pngEncoder{"parallel"};
+    int pngLevel{6};
+    // Limits per object cache, by name; 0 or missing is unlimited
+    std::map<std::string, size_t> cacheEntries{
+        { "world", 64 },
+        { "isosurface", 64 },
+        { "framebuffer", 16 },
+        // Keyed by the quality clients ask for, float sampling rate
+        // included, so this would grow without bound. Cameras need no
+        // limit, there is one per camera type and the pose is set on it.
+        { "renderer", 32 },
+    };
+    std::map<std::string, size_t> cacheBytes;
+    size_t memoryLimit{0};  // 0 is unlimited
+    // How volumes are stored once loaded: float, half, ushort or uchar
+    std::string precision{"float"};
+    std::map<std::string, std::string> volumePrecision;  // by volume name
+    size_t histogramBins{256};
+    std::string statsDirectory;  // empty means next to each volume's file
+    std::string catalog;  // empty means the compiled-in volumes
+    int lodLevels{3};  // downsampled copies kept of each volume, each half the last
+    int macrocellSize{16};  // voxels along each side of a cell of the min/max grid; 0 is none
+    size_t frameBudget{0};  // microseconds, for requests without their own; 0 is none
+    size_t latencyWindow{8};  // recent frame times the budget is checked against
+} gOptions;
+
 static void xDie(const char *fmt, ...) {
     std::va_list args;
     va_start(args, fmt);
@@ -37,9 +142,11 @@ struct stbiContext {
 static void stbiCallback(void *context_, void *data, int size) {
     stbiContext *context = static_cast<stbiContext *>(context_);
 
-    while (context->offset + size >= *context->size) {
-        *context->size *= 2;
-        *context->data = std::realloc(*context->data, *context->size);
+    // Output buffers are normally pre-sized by xImageBound, so this is the
+    // rare case and grows straight to the needed size
+    if (context->offset + size > *context->size) {
+        *context->size = std::max(2 * *context->size, context->offset + size);
+        *context->data = xCountedRealloc(*context->data, *context->size);
     }
 
     void *dest = static_cast<std::byte *>(*context->data) + context->offset;
@@ -50,10 +157,20 @@ static void stbiCallback(void *context_, void *data, int size) {
     context->offset += size;
 }
 
-static size_t __attribute__((unused)) xToJPG(const void *rgba, int width, int height, size_t *outsize, void **outdata) {
+static size_t xToJPG(const void *rgba, int width, int height, size_t stride, int quality, size_t *outsize, void **outdata) {
     if (*outsize == 0) {
         *outsize = 1024;
-        *outdata = std::malloc(*outsize);
+        *outdata = xCountedRealloc(nullptr, *outsize);
+    }
+
+    // stb's JPEG writer has no stride, so tiles are packed first
+    if (stride != 4UL * width) {
+        static std::vector<uint8_t> packed;
+        xResize(packed, 4UL * width * height);
+        for (int y=0; y<height; ++y) {
+            std::memcpy(packed.data() + 4UL * width * y, static_cast<const uint8_t *>(rgba) + stride * y, 4UL * width);
+        }
+        rgba = packed.data();
     }
 
     stbiContext context;
@@ -68,17 +185,16 @@ static size_t __attribute__((unused)) xToJPG(const void *rgba, int width, int he
     int h = height;
     int comp = 4;
     const void *data = rgba;
-    int quality = 95;
     success = stbi_write_jpg_to_func(func, context_, w, h, comp, data, quality);
     if (!success) xDie("Failed to stbi_write_jpg_to_func");
 
     return context.offset;
 }
 
-static size_t xToPNG(const void *rgba, int width, int height, size_t *outsize, void **outdata) {
+static size_t xToPNG(const void *rgba, int width, int height, size_t stride_, size_t *outsize, void **outdata) {
     if (*outsize == 0) {
         *outsize = 1024;
-        *outdata = std::malloc(*outsize);
+        *outdata = xCountedRealloc(nullptr, *outsize);
     }
 
     stbiContext context;
@@ -93,7 +209,7 @@ static size_t xToPNG(const void *rgba, int width, int height, size_t *outsize, v
     int h = height;
     int comp = 4;
     const void *data = rgba;
-    int stride = 0;
+    int stride = stride_;
     success = stbi_write_png_to_func(func, context_, w, h, comp, data, stride);
     if (!success) xDie("Failed to stbi_write_png_to_func");
 
@@ -112,598 +228,4322 @@ static void __attribute__((unused)) xWriteBytes(const std::string &filename, siz
     std::fclose(file);
 }
 
-static void *xReadBytes(const std::string &filename) {
-    std::FILE *file;
-    file = fopen(filename.c_str(), "rb");
-    if (!file) xDie("Failed to fopen: %s", filename.c_str());
-
-    {
-        int rv = std::fseek(file, 0, SEEK_END);
-        if (rv) xDie("Failed to fseek: %s", filename.c_str());
-    }
-
-    long nbyte;
-    nbyte = std::ftell(file);
-    if (nbyte < 0) xDie("Failed to ftell: %s", filename.c_str());
-
-    {
-        int rv = std::fseek(file, 0, SEEK_SET);
-        if (rv) xDie("Failed to fseek: %s", filename.c_str());
+// Set once io_uring turns out to be unusable here, e.g. blocked by seccomp
+static std::atomic<bool> gUringFailed{false};
+
+// Reads size bytes of the file into data, one --read-chunk at each chunk
+// aligned offset, with up to --read-depth of them in flight in one io_uring.
+// Short reads are resubmitted for the rest. Returns false if io_uring is
+// unavailable, which also sets gUringFailed, or a read fails, once nothing
+// is in flight any more. If what was submitted cannot be waited for, the
+// kernel may still write into data, so *abandoned is set and data must be
+// neither reused nor freed.
+static bool xReadUring(int fd, uint8_t *data, size_t size, bool *abandoned) {
+    *abandoned = false;
+
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int ring = static_cast<int>(syscall(__NR_io_uring_setup, gOptions.readDepth, &params));
+    if (ring < 0) {
+        std::fprintf(stderr, "Warning: io_uring_setup failed (errno %d), using threads from now on\n", errno);
+        gUringFailed = true;
+        return false;
     }
 
-    void *data;
-    data = new uint8_t[nbyte];
-    for (size_t i=0, n=nbyte; i<n; ++i) {
-        static_cast<uint8_t *>(data)[i] = 0x33;
+    // Older kernels map the completion queue on its own; not worth handling
+    size_t ringSize = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe)
+    );
+    size_t sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *rings = MAP_FAILED, *sqesMap = MAP_FAILED;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        rings = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
     }
-    std::size_t nread = std::fread(data, 1, nbyte, file);
-    if (static_cast<std::size_t>(nread) < static_cast<std::size_t>(nbyte)) {
-        xDie("Failed to read everything: %zu < %zu", nread, nbyte);
+    if (rings == MAP_FAILED || sqesMap == MAP_FAILED) {
+        if (rings != MAP_FAILED) munmap(rings, ringSize);
+        if (sqesMap != MAP_FAILED) munmap(sqesMap, sqesSize);
+        close(ring);
+        std::fprintf(stderr, "Warning: Failed to map the io_uring, using threads from now on\n");
+        gUringFailed = true;
+        return false;
     }
 
-    std::fclose(file);
+    uint8_t *base = static_cast<uint8_t *>(rings);
+    unsigned *sqTail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    unsigned sqMask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    unsigned *sqArray = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    unsigned *cqHead = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    unsigned *cqTail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    unsigned cqMask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    io_uring_cqe *cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(sqesMap);
+
+    // What is left of each read in flight, by slot, which is its user_data
+    unsigned depth = std::min<unsigned>(gOptions.readDepth, params.sq_entries);
+    std::vector<std::tuple<size_t, size_t>> reads(depth);  // offset, length
+    std::vector<unsigned> slots;
+    for (unsigned slot=depth; slot>0; --slot) slots.push_back(slot - 1);
+
+    unsigned pending = 0;  // queued but not yet submitted
+    auto submit = [&](unsigned slot) {
+        size_t offset, length;
+        std::tie(offset, length) = reads[slot];
+
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(data + offset);
+        sqe.len = static_cast<uint32_t>(length);
+        sqe.off = offset;
+        sqe.user_data = slot;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++pending;
+    };
+
+    bool ok = true;
+    size_t next = 0;
+    unsigned inflight = 0;
+    while (inflight > 0 || (ok && next < size)) {
+        while (ok && next < size && !slots.empty()) {
+            unsigned slot = slots.back();
+            slots.pop_back();
+            reads[slot] = std::make_tuple(next, std::min(gOptions.readChunk, size - next));
+            next += std::get<1>(reads[slot]);
+            submit(slot);
+            ++inflight;
+        }
 
-    return data;
-}
+        // Once something failed, only what was already submitted is waited for
+        long rv = syscall(__NR_io_uring_enter, ring, ok ? pending : 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0 && ok) {
+            // Reads queued but never submitted are dropped with the ring
+            std::fprintf(stderr, "Warning: io_uring_enter failed with %d reads in flight\n", inflight - pending);
+            ok = false;
+            inflight -= pending;
+            pending = 0;
+            continue;
+        }
+        if (rv < 0) {
+            // Nothing can be waited for, so the reads may still land
+            std::fprintf(stderr, "Warning: io_uring_enter failed again with %d reads in flight\n", inflight);
+            *abandoned = true;
+            break;
+        }
+        if (ok) pending -= static_cast<unsigned>(rv);
+
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe &cqe = cqes[head & cqMask];
+            unsigned slot = static_cast<unsigned>(cqe.user_data);
+            size_t offset, length;
+            std::tie(offset, length) = reads[slot];
+
+            if (!ok) {
+                // Draining, what it read no longer matters
+                slots.push_back(slot);
+                --inflight;
+            } else if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                submit(slot);
+            } else if (cqe.res <= 0) {
+                // Failed, or the file ended early
+                ok = false;
+                --inflight;
+            } else if (static_cast<size_t>(cqe.res) < length) {
+                reads[slot] = std::make_tuple(offset + cqe.res, length - cqe.res);
+                submit(slot);
+            } else {
+                slots.push_back(slot);
+                --inflight;
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
 
-template <class T>
-static T xCommit(T& t) {
-    ospCommit(t);
-    return t;
-}
+    munmap(sqesMap, sqesSize);
+    munmap(rings, ringSize);
+    close(ring);
 
-template <class T>
-static T xRetain(T& t) {
-    ospRetain(t);
-    return t;
+    return ok;
 }
 
-static OSPData xNewSharedData(const void *sharedData, OSPDataType dataType, uint64_t numItems1, uint64_t numItems2, uint64_t numItems3) {
-    OSPData data;
-    int64_t byteStride1 = 0;
-    int64_t byteStride2 = 0;
-    int64_t byteStride3 = 0;
-    std::fprintf(stderr, "ospNewSharedData: %p, %d, %lu, %ld, %lu, %ld, %lu, %ld)\n",
-        sharedData, dataType, numItems1, byteStride1, numItems2, byteStride2, numItems3, byteStride3);
-    data = ospNewSharedData(sharedData, dataType, numItems1, byteStride1, numItems2, byteStride2, numItems3, byteStride3);
+// The same reads with pread from --read-depth threads, each taking the next
+// chunk that nobody has yet
+static bool xReadThreads(int fd, uint8_t *data, size_t size) {
+    const size_t chunk = gOptions.readChunk;
+    const size_t count = (size + chunk - 1) / chunk;
+
+    std::atomic<size_t> next{0};
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> threads;
+    for (size_t i=0, n=std::min<size_t>(gOptions.readDepth, count); i<n; ++i) {
+        threads.emplace_back([&]() {
+            for (size_t c=next++; ok && c<count; c=next++) {
+                size_t offset = c * chunk;
+                size_t end = std::min(offset + chunk, size);
+                while (ok && offset < end) {
+                    ssize_t nread = pread(fd, data + offset, end - offset, offset);
+                    if (nread < 0 && errno == EINTR) continue;
+                    if (nread <= 0) ok = false;
+                    if (nread > 0) offset += nread;
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
 
-    return xCommit(data);
+    return ok;
 }
 
-static std::map<
-    std::tuple<std::string, int>,
-    std::tuple<
-        std::string,
-        std::tuple<int, int, int>,
-        std::tuple<float, float>
-    >
-> volumes = {
-#   include "detail/volumes.h"
-};
-
-static OSPVolume xNewVolume(const std::string &name, int timestep) {
-    using Key = std::tuple<std::string, int>;
-
-    Key key{name, timestep};
-    if (volumes.find(key) == volumes.end()) {
-        std::fprintf(stderr, "ERROR: Unknown volume! %s, %d\n", name.c_str(), timestep);
+// Whole files in many concurrent reads, so a cold load is bound by what the
+// device or filesystem can deliver rather than one stream of syscalls
+static void *xReadBytes(const std::string &filename, size_t *size) {
+    int fd;
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::fprintf(stderr, "ERROR: Failed to open: %s\n", filename.c_str());
         return nullptr;
     }
 
-    std::string filename;
-    std::tuple<float, float, float> dimensions;
-    std::tie(filename, dimensions, std::ignore) = volumes[key];
-    
-    int d1, d2, d3;
-    std::tie(d1, d2, d3) = dimensions;
-
-    OSPVolume volume;
-    const char *type = "structuredRegular";
-    volume = ospNewVolume(type);
-
-    OSPData data;
-    data = ({
-        OSPData data;
-        const void *sharedData = xReadBytes(filename);
-        OSPDataType dataType = OSP_FLOAT;
-        uint64_t numItems1 = d1;
-        uint64_t numItems2 = d2;
-        uint64_t numItems3 = d3;
-        data = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
-    
-        xCommit(data);
-    });
-    ospSetObject(volume, "data", data);
-
-    float gridOrigin[3] = { -0.5f*d1, -0.5f*d2, -0.5f*d3 };
-    ospSetParam(volume, "gridOrigin", OSP_VEC3F, gridOrigin);
-
-    float densityScale[] = { 0.1 };
-    ospSetParam(volume, "densityScale", OSP_FLOAT, densityScale);
+    struct stat st;
+    {
+        int rv = fstat(fd, &st);
+        if (rv) {
+            std::fprintf(stderr, "ERROR: Failed to fstat: %s\n", filename.c_str());
+            close(fd);
+            return nullptr;
+        }
+    }
 
-    // float gridSpacing[3] = { 1.0f/d1, 1.0f/d2, 1.0f/d3 };
-    // ospSetParam(volume, "gridSpacing", OSP_VEC3F, gridSpacing);
+    size_t nbyte;
+    nbyte = st.st_size;
 
-    // int cellCentered = 0;
-    // ospSetParam(volume, "cellCentered", OSP_BOOL, &cellCentered);
+    uint8_t *data;
+    data = new uint8_t[nbyte];
 
-    return volume;
-}
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point beforeRead = Clock::now();
+    bool abandoned = false;
+    const char *engine = ({
+        const char *engine = nullptr;
+        if (0) {
+        } else if (gOptions.readEngine == "uring" && !gUringFailed && xReadUring(fd, data, nbyte, &abandoned)) {
+            engine = "io_uring";
+        } else if (abandoned) {
+        } else if (gOptions.readEngine == "uring" && !gUringFailed) {
+            // A read failed rather than io_uring itself, so only this file
+            // is retried with threads
+            std::fprintf(stderr, "Warning: Failed to read with io_uring, retrying with threads: %s\n", filename.c_str());
+            engine = xReadThreads(fd, data, nbyte) ? "threads" : nullptr;
+        } else {
+            engine = xReadThreads(fd, data, nbyte) ? "threads" : nullptr;
+        }
+        engine;
+    });
+    Clock::time_point afterRead = Clock::now();
 
-static std::map<std::string, std::vector<float>> colorMaps{
-#   include "detail/colormaps.h"
-};
+    close(fd);
 
-static OSPData xNewColorMap(const std::string &name) {
-    if (colorMaps.find(name) == colorMaps.end()) {
-        std::fprintf(stderr, "ERROR: Colormap not found: %s\n", name.c_str());
+    if (!engine) {
+        std::fprintf(stderr, "ERROR: Failed to read everything: %s\n", filename.c_str());
+        // Leaked rather than freed while the kernel may still write to it
+        if (!abandoned) delete[] data;
         return nullptr;
     }
 
-    OSPData data;
-    const void *sharedData = colorMaps[name].data();
-    OSPDataType dataType = OSP_VEC3F;
-    uint64_t numItems1 = colorMaps[name].size() / 3;
-    uint64_t numItems2 = 1;
-    uint64_t numItems3 = 1;
-    data = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
+    // Small files, like the catalog, are not worth a line
+    using TimeUnit = std::chrono::microseconds;
+    size_t readDuration = std::chrono::duration_cast<TimeUnit>(afterRead - beforeRead).count();
+    if (nbyte >= gOptions.readChunk) std::fprintf(stderr, "Read %s: %zu MiB in %zu ms, %.2f GB/s (%s, depth %d, %zu KiB reads)\n",
+        filename.c_str(), nbyte >> 20, readDuration / 1000, nbyte / 1e3 / std::max<size_t>(readDuration, 1),
+        engine, gOptions.readDepth, gOptions.readChunk >> 10);
 
+    *size = nbyte;
     return data;
 }
 
-static OSPData xGetColorMap(const std::string &name) {
-    using Key = std::tuple<std::string>;
-    static std::map<Key, OSPData> cache;
+static void *xMapBytes(const std::string &filename, size_t *size, bool populate) {
+    int fd;
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::fprintf(stderr, "ERROR: Failed to open: %s\n", filename.c_str());
+        return nullptr;
+    }
 
-    Key key{name};
-    if (cache.find(key) == cache.end()) {
-        OSPData data;
-        data = xNewColorMap(name);
-        if (data == nullptr) {
+    struct stat st;
+    {
+        int rv = fstat(fd, &st);
+        if (rv) {
+            std::fprintf(stderr, "ERROR: Failed to fstat: %s\n", filename.c_str());
+            close(fd);
             return nullptr;
         }
-
-        cache[key] = xRetain(data);
     }
 
-    return cache[key];
-}
-
-static std::map<std::string, std::vector<float>> opacityMaps{
-#   include "detail/opacitymaps.h"
-};
+    size_t nbyte;
+    nbyte = st.st_size;
 
-static OSPData xNewOpacityMap(const std::string &name) {
-    if (opacityMaps.find(name) == opacityMaps.end()) {
-        std::fprintf(stderr, "ERROR: Opacity map not found: %s\n", name.c_str());
+    void *data;
+    data = ({
+        void *addr = nullptr;
+        size_t length = nbyte;
+        int prot = PROT_READ;
+        int flags = MAP_SHARED;
+        if (populate) flags |= MAP_POPULATE;
+        off_t offset = 0;
+        mmap(addr, length, prot, flags, fd, offset);
+    });
+    if (data == MAP_FAILED) {
+        // Also what an empty file gets
+        std::fprintf(stderr, "ERROR: Failed to mmap: %s\n", filename.c_str());
+        close(fd);
         return nullptr;
     }
 
-    OSPData data;
-    const void *sharedData = opacityMaps[name].data();
-    OSPDataType dataType = OSP_FLOAT;
-    uint64_t numItems1 = opacityMaps[name].size();
-    uint64_t numItems2 = 1;
-    uint64_t numItems3 = 1;
-    data = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
+    // The mapping holds its own reference to the file
+    close(fd);
+
+    int advice = ({
+        int advice;
+        if (0) {
+        } else if (gOptions.mmapAdvice == "normal") {
+            advice = MADV_NORMAL;
+        } else if (gOptions.mmapAdvice == "random") {
+            advice = MADV_RANDOM;
+        } else if (gOptions.mmapAdvice == "sequential") {
+            advice = MADV_SEQUENTIAL;
+        } else if (gOptions.mmapAdvice == "willneed") {
+            advice = MADV_WILLNEED;
+        } else if (gOptions.mmapAdvice == "hugepage") {
+            advice = MADV_HUGEPAGE;
+        } else {
+            xDie("Unknown mmap advice: %s", gOptions.mmapAdvice.c_str());
+        }
+        advice;
+    });
+    if (advice != MADV_NORMAL) {
+        int rv = madvise(data, nbyte, advice);
+        if (rv) std::fprintf(stderr, "Warning: Failed to madvise: %s\n", filename.c_str());
+    }
 
+    *size = nbyte;
     return data;
 }
 
-static OSPData xGetOpacityMap(const std::string &name) {
-    using Key = std::tuple<std::string>;
-    static std::map<Key, OSPData> cache;
+static void *xLoadBytes(const std::string &filename, size_t *size) {
+    if (0) {
+    } else if (gOptions.loadMode == "read") {
+        return xReadBytes(filename, size);
+    } else if (gOptions.loadMode == "mmap") {
+        return xMapBytes(filename, size, gOptions.mmapPopulate);
+    } else {
+        xDie("Unknown load mode: %s", gOptions.loadMode.c_str());
+    }
 
-    Key key{name};
-    if (cache.find(key) == cache.end()) {
-        OSPData data;
-        data = xNewOpacityMap(name);
-        if (data == nullptr) {
-            return nullptr;
+    return nullptr;
+}
+
+static void xUnloadBytes(void *data, size_t size) {
+    if (0) {
+    } else if (gOptions.loadMode == "read") {
+        delete[] static_cast<uint8_t *>(data);
+    } else if (gOptions.loadMode == "mmap") {
+        int rv = munmap(data, size);
+        if (rv) xDie("Failed to munmap: %p", data);
+    } else {
+        xDie("Unknown load mode: %s", gOptions.loadMode.c_str());
+    }
+}
+
+// Tasks wait in a ring that only grows, unlike a deque, which allocates
+// and frees blocks as tasks pass through it
+struct WorkQueue {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::vector<std::function<void()>> tasks;
+    size_t head{0};  // of the first waiting task in tasks
+    size_t waiting{0};
+    std::vector<std::thread> threads;
+    bool stopping{false};
+};
+
+static void xWorkQueueThread(WorkQueue *queue) {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->condition.wait(lock, [&]() { return queue->stopping || queue->waiting > 0; });
+            if (queue->waiting == 0) return;
+
+            task = std::move(queue->tasks[queue->head]);
+            queue->head = (queue->head + 1) % queue->tasks.size();
+            queue->waiting--;
         }
 
-        cache[key] = xRetain(data);
+        task();
     }
+}
 
-    return cache[key];
+static void xStartWorkQueue(WorkQueue &queue, int nthreads) {
+    for (int i=0; i<nthreads; ++i) {
+        queue.threads.emplace_back(xWorkQueueThread, &queue);
+    }
 }
 
-static OSPTransferFunction xNewTransferFunction(
-    const std::string &colorName,
-    const std::string &opacityName
-) {
-    OSPTransferFunction transferFunction;
-    const char *type = "piecewiseLinear";
-    transferFunction = ospNewTransferFunction(type);
+// Drops tasks that have not started yet and waits for the running ones
+static void xStopWorkQueue(WorkQueue &queue) {
+    {
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.stopping = true;
+        queue.tasks.clear();
+        queue.head = 0;
+        queue.waiting = 0;
+    }
+    queue.condition.notify_all();
 
-    OSPData color;
-    color = ({
-        OSPData data;
-        data = xGetColorMap(colorName);
-        if (data == nullptr) {
-            return nullptr;
-        }
-        
-        xCommit(data);
-    });
-    ospSetObject(transferFunction, "color", color);
+    for (std::thread &thread : queue.threads) {
+        thread.join();
+    }
+    queue.threads.clear();
+}
 
-    OSPData opacity;
-    opacity = ({
-        OSPData data;
-        data = xGetOpacityMap(opacityName);
-        if (data == nullptr) {
-            return nullptr;
+static void xSubmit(WorkQueue &queue, std::function<void()> task) {
+    {
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        if (queue.waiting == queue.tasks.size()) {
+            // Full: unroll the ring so the waiting tasks come first
+            std::rotate(queue.tasks.begin(), queue.tasks.begin() + queue.head, queue.tasks.end());
+            queue.tasks.resize(std::max<size_t>(2 * queue.tasks.size(), 16));
+            queue.head = 0;
         }
-        
-        xCommit(data);
-    });
-    ospSetObject(transferFunction, "opacity", opacity);
-
-    return transferFunction;
+        queue.tasks[(queue.head + queue.waiting) % queue.tasks.size()] = std::move(task);
+        queue.waiting++;
+    }
+    queue.condition.notify_one();
 }
 
-static OSPVolume xGetVolume(const std::string &name, int timestep) {
-    using Key = std::tuple<std::string, int>;
-    static std::map<Key, OSPVolume> cache;
+// Runs fn(0) .. fn(count-1) on the queue and the calling thread, and waits
+// for all of them. Each of up to one task per queue thread takes the next
+// index that nobody has yet. A task holds only a pointer, which
+// std::function stores without allocating, so a loop run every frame
+// allocates nothing.
+template <class Fn>
+static void xParallelFor(WorkQueue &queue, size_t count, const Fn &fn) {
+    if (count == 1 || queue.threads.empty()) {
+        for (size_t i=0; i<count; ++i) fn(i);
+        return;
+    }
 
-    Key key{name, timestep};
-    if (cache.find(key) == cache.end()) {
-        cache[key] = ({
-            OSPVolume volume;
-            volume = xNewVolume(name, timestep);
+    struct Loop {
+        const Fn *fn;
+        size_t count;
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable condition;
+        size_t running;
 
-            xRetain(volume);
+        void run() {
+            for (size_t i=next++; i<count; i=next++) (*fn)(i);
+        }
+    } loop;
+    loop.fn = &fn;
+    loop.count = count;
+    loop.running = std::min(count - 1, queue.threads.size());
+
+    for (size_t i=0, n=loop.running; i<n; ++i) {
+        Loop *l = &loop;
+        xSubmit(queue, [l]() {
+            l->run();
+
+            std::unique_lock<std::mutex> lock(l->mutex);
+            if (--l->running == 0) l->condition.notify_one();
         });
     }
 
-    return cache[key];
+    loop.run();
+
+    std::unique_lock<std::mutex> lock(loop.mutex);
+    loop.condition.wait(lock, [&]() { return loop.running == 0; });
 }
 
-static OSPGeometry xNewIsosurface(
-    const std::string &volumeName,
-    int timestep
-) {
-    OSPGeometry isosurface;
-    isosurface = ({
-        OSPGeometry geometry;
-        const char *type = "isosurface";
-        geometry = ospNewGeometry(type);
-    });
+static WorkQueue gComputeQueue;
+
+template <int Type>
+static inline uint8_t xPredict(int a, int b, int c) {
+    if (Type == 0) return 0;  // None
+    if (Type == 1) return a;  // Sub
+    if (Type == 2) return b;  // Up
+    if (Type == 3) return (a + b) >> 1;  // Average
+
+    // Paeth
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
 
-    OSPVolume volume;
-    volume = ({
-        OSPVolume volume;
-        volume = xGetVolume(volumeName, timestep);
+template <int Type>
+static size_t xFilterRow(const uint8_t *row, const uint8_t *prev, size_t n, uint8_t *out) {
+    size_t sum = 0;
+    for (size_t i=0; i<n; ++i) {
+        int a = i >= 4 ? row[i-4] : 0;
+        int b = prev ? prev[i] : 0;
+        int c = prev && i >= 4 ? prev[i-4] : 0;
+        uint8_t x = row[i] - xPredict<Type>(a, b, c);
+        if (out) out[i] = x;
+        sum += std::abs(static_cast<int8_t>(x));
+    }
+    return sum;
+}
 
-        xCommit(volume);
-    });
-    ospSetObject(isosurface, "volume", volume);
+// Same heuristic as stb: the filter with the smallest sum of absolute
+// signed residuals wins. out gets the filter type byte then n bytes.
+static void xFilterRowBest(const uint8_t *row, const uint8_t *prev, size_t n, uint8_t *out) {
+    size_t sums[5] = {
+        xFilterRow<0>(row, prev, n, nullptr),
+        xFilterRow<1>(row, prev, n, nullptr),
+        xFilterRow<2>(row, prev, n, nullptr),
+        xFilterRow<3>(row, prev, n, nullptr),
+        xFilterRow<4>(row, prev, n, nullptr),
+    };
+
+    int best = 0;
+    for (int type=1; type<5; ++type) {
+        if (sums[type] < sums[best]) best = type;
+    }
 
-    return isosurface;
+    out[0] = best;
+    switch (best) {
+    case 0: xFilterRow<0>(row, prev, n, out + 1); break;
+    case 1: xFilterRow<1>(row, prev, n, out + 1); break;
+    case 2: xFilterRow<2>(row, prev, n, out + 1); break;
+    case 3: xFilterRow<3>(row, prev, n, out + 1); break;
+    case 4: xFilterRow<4>(row, prev, n, out + 1); break;
+    }
 }
 
-static OSPGeometry xGetIsosurface(
-    const std::string &volumeName,
-    int timestep,
-    const std::vector<float> &isosurfaceValues
-) {
-    using Key = std::tuple<std::string, int>;
-    static std::map<Key, OSPGeometry> cache;
-    Key key{volumeName, timestep};
+static void xAppendBytes(stbiContext &context, const void *data, size_t size) {
+    stbiCallback(&context, const_cast<void *>(data), static_cast<int>(size));
+}
 
-    if (cache.find(key) == cache.end()) {
-        OSPGeometry isosurface;
-        isosurface = xNewIsosurface(volumeName, timestep);
+static void xAppendU32(stbiContext &context, uint32_t x) {
+    uint8_t bytes[4] = {
+        static_cast<uint8_t>(x >> 24),
+        static_cast<uint8_t>(x >> 16),
+        static_cast<uint8_t>(x >> 8),
+        static_cast<uint8_t>(x >> 0),
+    };
+    xAppendBytes(context, bytes, sizeof(bytes));
+}
+
+static void xAppendChunk(stbiContext &context, const char type[4], const void *data, size_t size) {
+    xAppendU32(context, size);
+    xAppendBytes(context, type, 4);
+    if (size) xAppendBytes(context, data, size);
 
-        cache[key] = xRetain(isosurface);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, reinterpret_cast<const Bytef *>(type), 4);
+    // crc32 with a null buffer would return the initial value, not crc
+    if (size) crc = crc32(crc, static_cast<const Bytef *>(data), size);
+    xAppendU32(context, crc);
+}
+
+// Filters and deflates horizontal stripes of the image concurrently, like
+// pigz: every stripe but the last ends with a sync flush so the raw
+// deflate streams concatenate, each is primed with the 32 KiB before it,
+// and the adler32 checksums are combined for the zlib trailer.
+static size_t xToPNGParallel(const void *rgba, int width, int height, size_t stride, size_t *outsize, void **outdata) {
+    if (*outsize == 0) {
+        *outsize = 1024;
+        *outdata = xCountedRealloc(nullptr, *outsize);
     }
 
-    OSPGeometry isosurface;
-    isosurface = cache[key];
+    const size_t rowBytes = 4UL * width;
+    const size_t filteredRowBytes = 1 + rowBytes;
+    const uint8_t *pixels = static_cast<const uint8_t *>(rgba);
 
-    OSPData isovalue;
-    isovalue = ({
-        OSPData data;
-        const void *sharedData = isosurfaceValues.data();
-        OSPDataType dataType = OSP_FLOAT;
-        uint64_t numItems1 = isosurfaceValues.size();
-        uint64_t numItems2 = 1;
-        uint64_t numItems3 = 1;
-        data = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
+    size_t nstripes = ({
+        const size_t minStripeBytes = 64UL * 1024UL;
+        size_t nstripes = (filteredRowBytes * height) / minStripeBytes;
+        size_t nthreads = std::max<size_t>(1, gComputeQueue.threads.size());
+        std::max<size_t>(1, std::min<size_t>({ nstripes, nthreads, static_cast<size_t>(height) }));
+    });
+    size_t rowsPerStripe = (height + nstripes - 1) / nstripes;
+    nstripes = (height + rowsPerStripe - 1) / rowsPerStripe;
+
+    // Only ever used by one encoding thread at a time. The deflate streams
+    // are reset rather than re-created, and a deque keeps them in place
+    // since zlib's internal state points back at its z_stream.
+    static std::vector<uint8_t> filtered;
+    static std::vector<std::vector<uint8_t>> compressed;
+    static std::vector<uLong> adlers;
+    static std::deque<z_stream> streams;
+    xResize(filtered, filteredRowBytes * height);
+    xResize(compressed, std::max(compressed.size(), nstripes));
+    xResize(adlers, nstripes);
+    while (streams.size() < nstripes) {
+        z_stream &stream = streams.emplace_back();
+        int rv = deflateInit2(&stream, gOptions.pngLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        if (rv != Z_OK) xDie("Failed to deflateInit2: %d", rv);
+        gEncodeStats.allocations++;
+    }
 
-        xCommit(data);
+    xParallelFor(gComputeQueue, nstripes, [&](size_t stripe) {
+        size_t begin = stripe * rowsPerStripe;
+        size_t end = std::min<size_t>(begin + rowsPerStripe, height);
+        for (size_t y=begin; y<end; ++y) {
+            const uint8_t *row = pixels + y * stride;
+            const uint8_t *prev = y > 0 ? row - stride : nullptr;
+            xFilterRowBest(row, prev, rowBytes, filtered.data() + y * filteredRowBytes);
+        }
+    });
+
+    xParallelFor(gComputeQueue, nstripes, [&](size_t stripe) {
+        size_t begin = stripe * rowsPerStripe * filteredRowBytes;
+        size_t end = std::min<size_t>(begin + rowsPerStripe * filteredRowBytes, filtered.size());
+        bool last = stripe + 1 == nstripes;
+
+        z_stream &stream = streams[stripe];
+        int rv = deflateReset(&stream);
+        if (rv != Z_OK) xDie("Failed to deflateReset: %d", rv);
+
+        if (begin > 0) {
+            size_t dictionaryBytes = std::min<size_t>(begin, 32UL * 1024UL);
+            rv = deflateSetDictionary(&stream, filtered.data() + begin - dictionaryBytes, dictionaryBytes);
+            if (rv != Z_OK) xDie("Failed to deflateSetDictionary: %d", rv);
+        }
+
+        std::vector<uint8_t> &out = compressed[stripe];
+        xResize(out, deflateBound(&stream, end - begin) + 16);  // + sync flush marker
+
+        stream.next_in = filtered.data() + begin;
+        stream.avail_in = end - begin;
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        rv = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (rv != (last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0) xDie("Failed to deflate: %d", rv);
+
+        out.resize(out.size() - stream.avail_out);
+
+        adlers[stripe] = adler32(adler32(0L, Z_NULL, 0), filtered.data() + begin, end - begin);
+    });
+
+    stbiContext context;
+    context.offset = 0;
+    context.size = outsize;
+    context.data = outdata;
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    xAppendBytes(context, signature, sizeof(signature));
+
+    uint8_t ihdr[13] = {
+        static_cast<uint8_t>(width >> 24), static_cast<uint8_t>(width >> 16),
+        static_cast<uint8_t>(width >> 8), static_cast<uint8_t>(width >> 0),
+        static_cast<uint8_t>(height >> 24), static_cast<uint8_t>(height >> 16),
+        static_cast<uint8_t>(height >> 8), static_cast<uint8_t>(height >> 0),
+        8,  // bit depth
+        6,  // color type: RGBA
+        0,  // compression
+        0,  // filter
+        0,  // interlace
+    };
+    xAppendChunk(context, "IHDR", ihdr, sizeof(ihdr));
+
+    // One IDAT chunk holding the zlib header, every stripe, and the trailer
+    size_t idatLength = 2 + 4;
+    for (size_t i=0; i<nstripes; ++i) {
+        idatLength += compressed[i].size();
+    }
+
+    uLong adler = adlers[0];
+    for (size_t i=1; i<nstripes; ++i) {
+        size_t begin = i * rowsPerStripe * filteredRowBytes;
+        size_t end = std::min<size_t>(begin + rowsPerStripe * filteredRowBytes, filtered.size());
+        adler = adler32_combine(adler, adlers[i], end - begin);
+    }
+
+    uint8_t zlibHeader[2] = {
+        0x78,  // deflate with a 32 KiB window
+        static_cast<uint8_t>(
+            gOptions.pngLevel <= 1 ? 0x01 :
+            gOptions.pngLevel <= 5 ? 0x5e :
+            gOptions.pngLevel == 6 ? 0x9c :
+            0xda
+        ),
+    };
+
+    xAppendU32(context, idatLength);
+    xAppendBytes(context, "IDAT", 4);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, reinterpret_cast<const Bytef *>("IDAT"), 4);
+
+    xAppendBytes(context, zlibHeader, sizeof(zlibHeader));
+    crc = crc32(crc, zlibHeader, sizeof(zlibHeader));
+    for (size_t i=0; i<nstripes; ++i) {
+        xAppendBytes(context, compressed[i].data(), compressed[i].size());
+        crc = crc32(crc, compressed[i].data(), compressed[i].size());
+    }
+
+    uint8_t zlibTrailer[4] = {
+        static_cast<uint8_t>(adler >> 24),
+        static_cast<uint8_t>(adler >> 16),
+        static_cast<uint8_t>(adler >> 8),
+        static_cast<uint8_t>(adler >> 0),
+    };
+    xAppendBytes(context, zlibTrailer, sizeof(zlibTrailer));
+    crc = crc32(crc, zlibTrailer, sizeof(zlibTrailer));
+    xAppendU32(context, crc);
+
+    xAppendChunk(context, "IEND", nullptr, 0);
+
+    return context.offset;
+}
+
+static size_t xEncodePNG(const void *rgba, int width, int height, size_t stride, size_t *outsize, void **outdata) {
+    if (0) {
+    } else if (gOptions.pngEncoder == "parallel") {
+        return xToPNGParallel(rgba, width, height, stride, outsize, outdata);
+    } else if (gOptions.pngEncoder == "stb") {
+        return xToPNG(rgba, width, height, stride, outsize, outdata);
+    } else {
+        xDie("Unknown PNG encoder: %s", gOptions.pngEncoder.c_str());
+    }
+
+    return 0;
+}
+
+// QOI, see https://qoiformat.org/qoi-specification.pdf. Worst case is a
+// QOI_OP_RGBA for every pixel, so the buffer is grown once up front.
+static size_t xToQOI(const void *rgba, int width, int height, size_t stride, size_t *outsize, void **outdata) {
+    size_t count = static_cast<size_t>(width) * height;
+    size_t maxsize = 14 + 5 * count + 8;
+    if (*outsize < maxsize) {
+        *outsize = maxsize;
+        *outdata = xCountedRealloc(*outdata, *outsize);
+    }
+
+    uint8_t *out = static_cast<uint8_t *>(*outdata);
+    size_t offset = 0;
+
+    auto put = [&](uint8_t x) { out[offset++] = x; };
+    auto put32 = [&](uint32_t x) {
+        put(x >> 24);
+        put(x >> 16);
+        put(x >> 8);
+        put(x >> 0);
+    };
+
+    put('q'); put('o'); put('i'); put('f');
+    put32(width);
+    put32(height);
+    put(4);  // channels
+    put(0);  // sRGB with linear alpha
+
+    const uint8_t *pixels = static_cast<const uint8_t *>(rgba);
+    uint8_t index[64][4] = {};
+    uint8_t prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    for (size_t i=0; i<count; ++i) {
+        const uint8_t *pixel = pixels + stride * (i / width) + 4 * (i % width);
+
+        if (std::memcmp(pixel, prev, 4) == 0) {
+            if (++run == 62 || i == count - 1) {
+                put(0xc0 | (run - 1));  // QOI_OP_RUN
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            put(0xc0 | (run - 1));  // QOI_OP_RUN
+            run = 0;
+        }
+
+        int hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64;
+        if (std::memcmp(index[hash], pixel, 4) == 0) {
+            put(hash);  // QOI_OP_INDEX
+            std::memcpy(prev, pixel, 4);
+            continue;
+        }
+        std::memcpy(index[hash], pixel, 4);
+
+        if (pixel[3] != prev[3]) {
+            put(0xff);  // QOI_OP_RGBA
+            put(pixel[0]);
+            put(pixel[1]);
+            put(pixel[2]);
+            put(pixel[3]);
+            std::memcpy(prev, pixel, 4);
+            continue;
+        }
+
+        int8_t dr = static_cast<int8_t>(pixel[0] - prev[0]);
+        int8_t dg = static_cast<int8_t>(pixel[1] - prev[1]);
+        int8_t db = static_cast<int8_t>(pixel[2] - prev[2]);
+        int8_t drdg = static_cast<int8_t>(dr - dg);
+        int8_t dbdg = static_cast<int8_t>(db - dg);
+
+        if (-2 <= dr && dr <= 1 && -2 <= dg && dg <= 1 && -2 <= db && db <= 1) {
+            put(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));  // QOI_OP_DIFF
+        } else if (-8 <= drdg && drdg <= 7 && -32 <= dg && dg <= 31 && -8 <= dbdg && dbdg <= 7) {
+            put(0x80 | (dg + 32));  // QOI_OP_LUMA
+            put((drdg + 8) << 4 | (dbdg + 8));
+        } else {
+            put(0xfe);  // QOI_OP_RGB
+            put(pixel[0]);
+            put(pixel[1]);
+            put(pixel[2]);
+        }
+
+        std::memcpy(prev, pixel, 4);
+    }
+
+    for (int i=0; i<7; ++i) put(0x00);
+    put(0x01);
+
+    return offset;
+}
+
+// Unencoded 8-bit RGBA rows, top to bottom like the frame buffer
+static size_t xToRGBA(const void *rgba, int width, int height, size_t stride, size_t *outsize, void **outdata) {
+    size_t rowBytes = 4UL * width;
+    size_t size = rowBytes * height;
+    if (*outsize < size) {
+        *outsize = size;
+        *outdata = xCountedRealloc(*outdata, *outsize);
+    }
+
+    for (int y=0; y<height; ++y) {
+        std::memcpy(static_cast<uint8_t *>(*outdata) + rowBytes * y, static_cast<const uint8_t *>(rgba) + stride * y, rowBytes);
+    }
+
+    return size;
+}
+
+enum class ImageEncoding : uint8_t {
+    PNG = 0,
+    JPEG = 1,
+    QOI = 2,
+    RGBA = 3,
+};
+
+struct ImageFormat {
+    ImageEncoding encoding;
+    int quality;  // 1..100, only used by JPEG
+};
+
+static bool xParseImageEncoding(const std::string &name, ImageEncoding &encoding) {
+    if (0) {
+    } else if (name == "png") {
+        encoding = ImageEncoding::PNG;
+    } else if (name == "jpeg") {
+        encoding = ImageEncoding::JPEG;
+    } else if (name == "qoi") {
+        encoding = ImageEncoding::QOI;
+    } else if (name == "rgba") {
+        encoding = ImageEncoding::RGBA;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// stride is the distance in bytes between rows of rgba, so a tile can be
+// encoded in place from the frame buffer it was rendered into
+static size_t xEncodeImage(const void *rgba, int width, int height, size_t stride, ImageFormat format, size_t *outsize, void **outdata) {
+    if (0) {
+    } else if (format.encoding == ImageEncoding::PNG) {
+        return xEncodePNG(rgba, width, height, stride, outsize, outdata);
+    } else if (format.encoding == ImageEncoding::JPEG) {
+        return xToJPG(rgba, width, height, stride, format.quality, outsize, outdata);
+    } else if (format.encoding == ImageEncoding::QOI) {
+        return xToQOI(rgba, width, height, stride, outsize, outdata);
+    } else if (format.encoding == ImageEncoding::RGBA) {
+        return xToRGBA(rgba, width, height, stride, outsize, outdata);
+    } else {
+        xDie("Unknown image encoding: %u", static_cast<unsigned>(format.encoding));
+    }
+
+    return 0;
+}
+
+// Upper bound on the encoded size, generous enough that the output buffer
+// never has to grow in practice
+static size_t xImageBound(int width, int height, ImageEncoding encoding) {
+    size_t pixels = static_cast<size_t>(width) * height;
+    size_t filtered = (4 * static_cast<size_t>(width) + 1) * height;
+    if (0) {
+    } else if (encoding == ImageEncoding::PNG) {
+        return filtered + filtered / 64 + 1024;
+    } else if (encoding == ImageEncoding::JPEG) {
+        return 4 * pixels + 1024;
+    } else if (encoding == ImageEncoding::QOI) {
+        return 14 + 5 * pixels + 8;
+    } else if (encoding == ImageEncoding::RGBA) {
+        return 4 * pixels;
+    }
+
+    return 1024;
+}
+
+// Encoded output buffers, one per resolution, encoding and tile index,
+// reused from frame to frame. Only used by one encoding thread: main, or
+// the encoder when pipelining.
+static std::map<std::tuple<int, int, ImageEncoding, size_t>, std::tuple<size_t, void *>> gImageArenas;
+
+static std::tuple<size_t, void *> &xGetImageArena(int width, int height, ImageEncoding encoding, size_t index) {
+    auto key = std::make_tuple(width, height, encoding, index);
+    auto it = gImageArenas.find(key);
+    if (it != gImageArenas.end()) {
+        return it->second;
+    }
+
+    size_t size = xImageBound(width, height, encoding);
+    void *data = xCountedRealloc(nullptr, size);
+    gEncodeStats.allocations++;  // the map node
+    gMemory.encodeBytes += size;
+
+    return gImageArenas.emplace(key, std::make_tuple(size, data)).first->second;
+}
+
+template <class T>
+static T xCommit(T& t) {
+    ospCommit(t);
+    return t;
+}
+
+template <class T>
+static T xRetain(T& t) {
+    ospRetain(t);
+    return t;
+}
+
+static const char *const kCacheNames[] = {
+    "colormap", "opacitymap", "volume", "isosurface", "world", "framebuffer", "camera", "renderer",
+};
+
+// Least recently used cache of OSPRay objects, bounded by the
+// --cache-entries and --cache-bytes limits for its name. The cache owns
+// one reference to every object and releases it on eviction, so objects
+// still used elsewhere (a volume by a world, say) outlive their entry.
+// Only used from the main thread.
+template <typename Key, typename Value>
+struct LRUCache {
+    std::string name;
+    std::atomic<size_t> *memory{nullptr};  // also counted here, if set
+    size_t bytes{0};
+    std::list<Key> order{};  // least recently used first
+    std::map<Key, std::tuple<Value, size_t, typename std::list<Key>::iterator>> entries{};
+};
+
+template <typename Key, typename Value>
+static auto xCacheEvict(LRUCache<Key, Value> &cache, typename decltype(cache.entries)::iterator it) {
+    ospRelease(std::get<0>(it->second));
+    cache.bytes -= std::get<1>(it->second);
+    if (cache.memory) *cache.memory -= std::get<1>(it->second);
+    cache.order.erase(std::get<2>(it->second));
+    return cache.entries.erase(it);
+}
+
+template <typename Key, typename Value>
+static Value xCacheGet(LRUCache<Key, Value> &cache, const Key &key) {
+    auto it = cache.entries.find(key);
+    if (it == cache.entries.end()) {
+        return nullptr;
+    }
+
+    auto position = std::get<2>(it->second);
+    cache.order.splice(cache.order.end(), cache.order, position);
+
+    return std::get<0>(it->second);
+}
+
+// Takes over the caller's reference to value
+template <typename Key, typename Value>
+static Value xCachePut(LRUCache<Key, Value> &cache, const Key &key, Value value, size_t bytes) {
+    auto limit = [&](const std::map<std::string, size_t> &limits) -> size_t {
+        auto it = limits.find(cache.name);
+        return it == limits.end() ? 0 : it->second;
+    };
+    size_t maxEntries = limit(gOptions.cacheEntries);
+    size_t maxBytes = limit(gOptions.cacheBytes);
+
+    while (!cache.order.empty() && (
+        (maxEntries != 0 && cache.entries.size() + 1 > maxEntries) ||
+        (maxBytes != 0 && cache.bytes + bytes > maxBytes)
+    )) {
+        xCacheEvict(cache, cache.entries.find(cache.order.front()));
+    }
+
+    cache.order.push_back(key);
+    cache.entries.emplace(key, std::make_tuple(value, bytes, std::prev(cache.order.end())));
+    cache.bytes += bytes;
+    if (cache.memory) *cache.memory += bytes;
+
+    return value;
+}
+
+// Evicts every entry whose key matches predicate
+template <typename Key, typename Value, typename Predicate>
+static void xCacheErase(LRUCache<Key, Value> &cache, Predicate predicate) {
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); ) {
+        it = predicate(it->first) ? xCacheEvict(cache, it) : std::next(it);
+    }
+}
+
+static OSPData xNewSharedData(const void *sharedData, OSPDataType dataType, uint64_t numItems1, uint64_t numItems2, uint64_t numItems3) {
+    OSPData data;
+    int64_t byteStride1 = 0;
+    int64_t byteStride2 = 0;
+    int64_t byteStride3 = 0;
+    std::fprintf(stderr, "ospNewSharedData: %p, %d, %lu, %ld, %lu, %ld, %lu, %ld)\n",
+        sharedData, dataType, numItems1, byteStride1, numItems2, byteStride2, numItems3, byteStride3);
+    data = ospNewSharedData(sharedData, dataType, numItems1, byteStride1, numItems2, byteStride2, numItems3, byteStride3);
+
+    return xCommit(data);
+}
+
+using VolumeInfo = std::tuple<
+    std::string,  // filename
+    std::tuple<int, int, int>,  // dimensions
+    std::tuple<float, float>  // domain
+>;
+
+// Starts out as the compiled-in table and is replaced by --catalog, which
+// can be read again while serving. Loads run on other threads, so every
+// access goes through gVolumesMutex.
+static std::mutex gVolumesMutex;
+static std::map<std::tuple<std::string, int>, VolumeInfo> volumes = {
+#   include "detail/volumes.h"
+};
+
+static bool xFindVolume(const std::tuple<std::string, int> &key, VolumeInfo *info=nullptr) {
+    std::unique_lock<std::mutex> lock(gVolumesMutex);
+    auto it = volumes.find(key);
+    if (it == volumes.end()) {
+        return false;
+    }
+
+    if (info) *info = it->second;
+    return true;
+}
+
+// Just enough JSON for the catalog
+struct JsonValue {
+    enum class Type { Null, Boolean, Number, String, Array, Object } type{Type::Null};
+    bool boolean{false};
+    double number{0.0};
+    std::string string;
+    std::vector<JsonValue> array;  // also the values of an object
+    std::vector<std::string> keys;  // of an object, in order
+
+    const JsonValue *find(const std::string &key) const {
+        for (size_t i=0, n=keys.size(); i<n; ++i) {
+            if (keys[i] == key) return &array[i];
+        }
+        return nullptr;
+    }
+};
+
+struct JsonReader {
+    const char *begin;
+    const char *cursor;
+    const char *end;
+    std::string error;
+};
+
+static void xJsonSkip(JsonReader &reader) {
+    while (reader.cursor < reader.end && std::isspace(static_cast<unsigned char>(*reader.cursor))) {
+        ++reader.cursor;
+    }
+}
+
+static bool xJsonFail(JsonReader &reader, const char *what) {
+    if (reader.error.empty()) {
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), " at byte %zu", static_cast<size_t>(reader.cursor - reader.begin));
+        reader.error = std::string(what) + buffer;
+    }
+    return false;
+}
+
+static bool xJsonParse(JsonReader &reader, JsonValue &value, int depth=0);
+
+static bool xJsonParseString(JsonReader &reader, std::string &string) {
+    ++reader.cursor;  // opening quote
+    while (reader.cursor < reader.end && *reader.cursor != '"') {
+        char c = *reader.cursor++;
+        if (c != '\\') {
+            string.push_back(c);
+            continue;
+        }
+
+        if (reader.cursor == reader.end) break;
+        c = *reader.cursor++;
+        if (0) {
+        } else if (c == 'n') { string.push_back('\n');
+        } else if (c == 't') { string.push_back('\t');
+        } else if (c == 'r') { string.push_back('\r');
+        } else if (c == 'b') { string.push_back('\b');
+        } else if (c == 'f') { string.push_back('\f');
+        } else if (c == 'u') {
+            // Paths and names are ASCII; anything else is not worth UTF-8 encoding here
+            if (reader.end - reader.cursor < 4) return xJsonFail(reader, "Truncated escape");
+            unsigned long code = std::strtoul(std::string(reader.cursor, 4).c_str(), nullptr, 16);
+            string.push_back(code < 0x80 ? static_cast<char>(code) : '?');
+            reader.cursor += 4;
+        } else {
+            string.push_back(c);
+        }
+    }
+
+    if (reader.cursor == reader.end) return xJsonFail(reader, "Unterminated string");
+    ++reader.cursor;  // closing quote
+    return true;
+}
+
+static bool xJsonParse(JsonReader &reader, JsonValue &value, int depth) {
+    if (depth > 64) return xJsonFail(reader, "Nested too deeply");
+
+    xJsonSkip(reader);
+    if (reader.cursor == reader.end) return xJsonFail(reader, "Unexpected end");
+
+    auto literal = [&](const char *word) {
+        size_t n = std::strlen(word);
+        if (static_cast<size_t>(reader.end - reader.cursor) < n || std::memcmp(reader.cursor, word, n) != 0) return false;
+        reader.cursor += n;
+        return true;
+    };
+
+    char c = *reader.cursor;
+    if (0) {
+    } else if (c == '{' || c == '[') {
+        bool object = c == '{';
+        char close = object ? '}' : ']';
+        value.type = object ? JsonValue::Type::Object : JsonValue::Type::Array;
+        ++reader.cursor;
+
+        xJsonSkip(reader);
+        if (reader.cursor < reader.end && *reader.cursor == close) {
+            ++reader.cursor;
+            return true;
+        }
+
+        for (;;) {
+            if (object) {
+                xJsonSkip(reader);
+                if (reader.cursor == reader.end || *reader.cursor != '"') return xJsonFail(reader, "Expected key");
+                value.keys.emplace_back();
+                if (!xJsonParseString(reader, value.keys.back())) return false;
+
+                xJsonSkip(reader);
+                if (reader.cursor == reader.end || *reader.cursor != ':') return xJsonFail(reader, "Expected ':'");
+                ++reader.cursor;
+            }
+
+            value.array.emplace_back();
+            if (!xJsonParse(reader, value.array.back(), depth + 1)) return false;
+
+            xJsonSkip(reader);
+            if (reader.cursor == reader.end) return xJsonFail(reader, "Unexpected end");
+            c = *reader.cursor++;
+            if (c == close) return true;
+            if (c != ',') return xJsonFail(reader, "Expected ','");
+        }
+    } else if (c == '"') {
+        value.type = JsonValue::Type::String;
+        return xJsonParseString(reader, value.string);
+    } else if (literal("true")) {
+        value.type = JsonValue::Type::Boolean;
+        value.boolean = true;
+        return true;
+    } else if (literal("false")) {
+        value.type = JsonValue::Type::Boolean;
+        value.boolean = false;
+        return true;
+    } else if (literal("null")) {
+        value.type = JsonValue::Type::Null;
+        return true;
+    } else {
+        // The buffer is not NUL terminated, so strtod gets a copy
+        const char *begin = reader.cursor;
+        while (reader.cursor < reader.end && std::strchr("+-.0123456789eE", *reader.cursor)) {
+            ++reader.cursor;
+        }
+        std::string number(begin, reader.cursor);
+        char *last;
+        value.type = JsonValue::Type::Number;
+        value.number = std::strtod(number.c_str(), &last);
+        if (number.empty() || *last != '\0') return xJsonFail(reader, "Expected a value");
+        return true;
+    }
+
+    return false;
+}
+
+// A catalog is a JSON object listing volumes like the compiled-in table:
+//
+//   { "volumes": [
+//       { "name": "teapot", "timestep": 0, "filename": "/data/teapot.raw",
+//         "dimensions": [256, 256, 178], "domain": [0, 255] }
+//   ] }
+//
+// timestep defaults to 0. domain is optional, since the range computed
+// when the volume is loaded replaces it anyway.
+static bool xReadCatalog(const std::string &filename, std::map<std::tuple<std::string, int>, VolumeInfo> &catalog) {
+    size_t size = 0;
+    char *bytes = static_cast<char *>(xReadBytes(filename, &size));
+    if (!bytes) {
+        return false;
+    }
+
+    JsonReader reader{ bytes, bytes, bytes + size, "" };
+    JsonValue root;
+    bool ok = xJsonParse(reader, root);
+    delete[] bytes;
+    if (!ok) {
+        std::fprintf(stderr, "ERROR: %s: %s\n", filename.c_str(), reader.error.c_str());
+        return false;
+    }
+
+    const JsonValue *entries = root.find("volumes");
+    if (!entries || entries->type != JsonValue::Type::Array) {
+        std::fprintf(stderr, "ERROR: %s: Expected a \"volumes\" array\n", filename.c_str());
+        return false;
+    }
+
+    auto numbers = [](const JsonValue *value, size_t count, double *out) {
+        if (!value || value->type != JsonValue::Type::Array || value->array.size() != count) return false;
+        for (size_t i=0; i<count; ++i) {
+            if (value->array[i].type != JsonValue::Type::Number) return false;
+            out[i] = value->array[i].number;
+        }
+        return true;
+    };
+
+    // Whole numbers in [lo, INT_MAX], which is all that converts to int
+    auto integer = [](double x, double lo) {
+        return x >= lo && x <= std::numeric_limits<int>::max() && x == std::floor(x);
+    };
+
+    for (size_t i=0, n=entries->array.size(); i<n; ++i) {
+        const JsonValue &entry = entries->array[i];
+        const JsonValue *name = entry.find("name");
+        const JsonValue *timestep = entry.find("timestep");
+        const JsonValue *path = entry.find("filename");
+        double dimensions[3];
+        double domain[2] = { 0.0, 1.0 };
+
+        bool valid = name && name->type == JsonValue::Type::String && !name->string.empty();
+        valid = valid && (!timestep || (timestep->type == JsonValue::Type::Number && integer(timestep->number, std::numeric_limits<int>::min())));
+        valid = valid && path && path->type == JsonValue::Type::String;
+        valid = valid && numbers(entry.find("dimensions"), 3, dimensions);
+        valid = valid && integer(dimensions[0], 1) && integer(dimensions[1], 1) && integer(dimensions[2], 1);
+        valid = valid && (!entry.find("domain") || numbers(entry.find("domain"), 2, domain));
+        if (!valid) {
+            std::fprintf(stderr, "ERROR: %s: Volume %zu needs a name, a filename and whole dimensions of at least 1, and a whole timestep if any\n", filename.c_str(), i);
+            return false;
+        }
+
+        std::tuple<std::string, int> key{ name->string, timestep ? static_cast<int>(timestep->number) : 0 };
+        catalog[key] = VolumeInfo{
+            path->string,
+            { static_cast<int>(dimensions[0]), static_cast<int>(dimensions[1]), static_cast<int>(dimensions[2]) },
+            { static_cast<float>(domain[0]), static_cast<float>(domain[1]) },
+        };
+    }
+
+    return true;
+}
+
+// Bricked volumes, written by tools/raw2bricks.py, are recognized by their
+// extension. Each brick repeats the first layer of voxels of its neighbours
+// on the high side, so bricks rendered next to each other interpolate
+// across the seams. Everything is little endian and each brick starts on a
+// page boundary.
+struct __attribute__((packed)) BrickFileHeader {
+    char magic[4];  // TAPB
+    uint32_t version;
+    int32_t dimensions[3];
+    int32_t brickSize;  // without the shared layer
+    int32_t brickCounts[3];
+    uint32_t reserved;
+    double mean;
+    uint64_t tableOffset;  // of brickCounts[0] * [1] * [2] BrickFileEntry
+};
+
+struct __attribute__((packed)) BrickFileEntry {
+    uint64_t offset;  // of the brick's floats, x fastest
+    int32_t origin[3];  // of its first voxel in the volume
+    int32_t dimensions[3];  // including the shared layer
+    float lo;
+    float hi;
+};
+
+static const char kBrickMagic[4] = { 'T', 'A', 'P', 'B' };
+static const uint32_t kBrickVersion = 1;
+
+static const BrickFileEntry *xGetBricks(const void *bytes) {
+    const BrickFileHeader *header = static_cast<const BrickFileHeader *>(bytes);
+    return reinterpret_cast<const BrickFileEntry *>(static_cast<const uint8_t *>(bytes) + header->tableOffset);
+}
+
+static bool xIsBricked(const std::tuple<std::string, int> &key) {
+    VolumeInfo info;
+    if (!xFindVolume(key, &info)) {
+        return false;
+    }
+
+    const std::string &filename = std::get<0>(info);
+    const std::string extension = ".bricks";
+    return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// Bricks are rendered straight from the file, so they are always float
+static const std::string &xGetPrecision(const std::tuple<std::string, int> &key) {
+    static const std::string kFloat{"float"};
+    if (xIsBricked(key)) {
+        return kFloat;
+    }
+
+    auto it = gOptions.volumePrecision.find(std::get<0>(key));
+    return it == gOptions.volumePrecision.end() ? gOptions.precision : it->second;
+}
+
+static size_t xPrecisionBytes(const std::string &precision) {
+    if (0) {
+    } else if (precision == "float") {
+        return sizeof(float);
+    } else if (precision == "half") {
+        return sizeof(uint16_t);
+    } else if (precision == "ushort") {
+        return sizeof(uint16_t);
+    } else if (precision == "uchar") {
+        return sizeof(uint8_t);
+    } else {
+        xDie("Unknown precision: %s", precision.c_str());
+    }
+
+    return 0;
+}
+
+static OSPDataType xPrecisionDataType(const std::string &precision) {
+    if (0) {
+    } else if (precision == "float") {
+        return OSP_FLOAT;
+    } else if (precision == "half") {
+        return OSP_HALF;
+    } else if (precision == "ushort") {
+        return OSP_USHORT;
+    } else if (precision == "uchar") {
+        return OSP_UCHAR;
+    } else {
+        xDie("Unknown precision: %s", precision.c_str());
+    }
+
+    return OSP_FLOAT;
+}
+
+// Reduced precision volumes hold their domain mapped onto [0, scale]
+static float xPrecisionScale(const std::string &precision) {
+    if (0) {
+    } else if (precision == "half") {
+        return 1.0f;
+    } else if (precision == "ushort") {
+        return 65535.0f;
+    } else if (precision == "uchar") {
+        return 255.0f;
+    } else {
+        xDie("Unknown precision: %s", precision.c_str());
+    }
+
+    return 1.0f;
+}
+
+// Computed from the data as each volume is loaded and kept in a sidecar
+// file, so later loads only need to read it back
+struct VolumeStats {
+    float lo;
+    float hi;
+    double mean;
+    std::vector<uint64_t> histogram;  // evenly spaced bins over [lo, hi]
+};
+
+static std::mutex gVolumeStatsMutex;
+static std::map<std::tuple<std::string, int>, VolumeStats> gVolumeStats;
+
+// The transfer function domain. The table's range is only used until the
+// volume has been loaded once.
+static std::tuple<float, float> xGetDomain(const std::tuple<std::string, int> &key) {
+    {
+        std::unique_lock<std::mutex> lock(gVolumeStatsMutex);
+        auto it = gVolumeStats.find(key);
+        if (it != gVolumeStats.end()) {
+            return std::make_tuple(it->second.lo, it->second.hi);
+        }
+    }
+
+    VolumeInfo info;
+    if (!xFindVolume(key, &info)) {
+        return std::make_tuple(0.0f, 1.0f);
+    }
+
+    return std::get<2>(info);
+}
+
+// Each chunk keeps a few independent lanes so the reductions have no
+// loop-carried dependency and the compiler can vectorize them. NaNs and
+// infinities (fill values in some datasets) are left out of every
+// statistic, or they would become the domain.
+static VolumeStats xComputeVolumeStats(const float *data, size_t count, size_t bins) {
+    const size_t chunk = 1UL << 20;
+    size_t nchunks = (count + chunk - 1) / chunk;
+
+    constexpr size_t kLanes = 8;
+    std::vector<float> chunkLo(nchunks), chunkHi(nchunks);
+    std::vector<double> chunkSum(nchunks);
+    std::vector<size_t> chunkCount(nchunks);
+    xParallelFor(gComputeQueue, nchunks, [&](size_t i) {
+        const float *in = data + i * chunk;
+        size_t n = std::min(chunk, count - i * chunk);
+
+        float lo[kLanes], hi[kLanes];
+        double sum[kLanes];
+        size_t valid[kLanes];
+        for (size_t k=0; k<kLanes; ++k) {
+            lo[k] = std::numeric_limits<float>::infinity();
+            hi[k] = -std::numeric_limits<float>::infinity();
+            sum[k] = 0.0;
+            valid[k] = 0;
+        }
+
+        auto accumulate = [&](size_t k, float x) {
+            bool ok = std::isfinite(x);
+            lo[k] = ok && x < lo[k] ? x : lo[k];
+            hi[k] = ok && x > hi[k] ? x : hi[k];
+            sum[k] += ok ? x : 0.0f;
+            valid[k] += ok;
+        };
+
+        size_t j = 0;
+        for (; j + kLanes <= n; j += kLanes) {
+            for (size_t k=0; k<kLanes; ++k) accumulate(k, in[j + k]);
+        }
+        for (; j < n; ++j) accumulate(0, in[j]);
+
+        chunkLo[i] = *std::min_element(lo, lo + kLanes);
+        chunkHi[i] = *std::max_element(hi, hi + kLanes);
+        chunkSum[i] = 0.0;
+        chunkCount[i] = 0;
+        for (size_t k=0; k<kLanes; ++k) {
+            chunkSum[i] += sum[k];
+            chunkCount[i] += valid[k];
+        }
+    });
+
+    VolumeStats stats;
+    stats.lo = *std::min_element(chunkLo.begin(), chunkLo.end());
+    stats.hi = *std::max_element(chunkHi.begin(), chunkHi.end());
+    size_t valid = 0;
+    stats.mean = 0.0;
+    for (size_t i=0; i<nchunks; ++i) {
+        stats.mean += chunkSum[i];
+        valid += chunkCount[i];
+    }
+    stats.mean = valid ? stats.mean / valid : 0.0;
+    if (!valid) {
+        stats.lo = 0.0f;
+        stats.hi = 0.0f;
+    }
+
+    // The bins need the range, so they take a second sweep over the
+    // (by now resident) data
+    std::vector<std::vector<uint64_t>> chunkHistogram(nchunks, std::vector<uint64_t>(bins));
+    float scale = stats.hi > stats.lo ? bins / (stats.hi - stats.lo) : 0.0f;
+    float last = bins - 1;
+    xParallelFor(gComputeQueue, nchunks, [&](size_t i) {
+        const float *in = data + i * chunk;
+        size_t n = std::min(chunk, count - i * chunk);
+
+        uint64_t *histogram = chunkHistogram[i].data();
+        for (size_t j=0; j<n; ++j) {
+            if (!std::isfinite(in[j])) continue;
+            float x = (in[j] - stats.lo) * scale;
+            x = x >= 0.0f ? x : 0.0f;
+            x = x < last ? x : last;
+            ++histogram[static_cast<size_t>(x)];
+        }
+    });
+
+    stats.histogram.assign(bins, 0);
+    for (const std::vector<uint64_t> &histogram : chunkHistogram) {
+        for (size_t b=0; b<bins; ++b) stats.histogram[b] += histogram[b];
+    }
+
+    return stats;
+}
+
+static std::string xStatsFilename(const std::string &filename) {
+    if (gOptions.statsDirectory.empty()) {
+        return filename + ".stats";
+    }
+
+    size_t slash = filename.rfind('/');
+    std::string basename = slash == std::string::npos ? filename : filename.substr(slash + 1);
+    return gOptions.statsDirectory + "/" + basename + ".stats";
+}
+
+// Sidecars record the size and modification time of the file they were
+// computed from and are ignored once either changes
+static bool xReadVolumeStats(const std::string &filename, const struct stat &st, VolumeStats *stats) {
+    std::FILE *file;
+    file = std::fopen(xStatsFilename(filename).c_str(), "r");
+    if (!file) {
+        return false;
+    }
+
+    bool ok = ({
+        unsigned long long size;
+        long long mtime;
+        size_t bins;
+        bool ok = std::fscanf(file, "tapestry-stats 1 %llu %lld %f %f %lf %zu", &size, &mtime, &stats->lo, &stats->hi, &stats->mean, &bins) == 6;
+        ok = ok && size == static_cast<unsigned long long>(st.st_size);
+        ok = ok && mtime == static_cast<long long>(st.st_mtime);
+        ok = ok && bins == gOptions.histogramBins;
+        if (ok) {
+            stats->histogram.resize(bins);
+            for (size_t b=0; ok && b<bins; ++b) {
+                unsigned long long value;
+                ok = std::fscanf(file, "%llu", &value) == 1;
+                stats->histogram[b] = value;
+            }
+        }
+        ok;
+    });
+
+    std::fclose(file);
+    return ok;
+}
+
+static void xWriteVolumeStats(const std::string &filename, const struct stat &st, const VolumeStats &stats) {
+    std::string statsFilename = xStatsFilename(filename);
+    std::string temporary = statsFilename + ".tmp";
+
+    std::FILE *file;
+    file = std::fopen(temporary.c_str(), "w");
+    if (!file) {
+        std::fprintf(stderr, "Warning: Failed to fopen: %s\n", temporary.c_str());
+        return;
+    }
+
+    std::fprintf(file, "tapestry-stats 1\n%llu %lld\n%.9g %.9g %.17g\n%zu\n",
+        static_cast<unsigned long long>(st.st_size), static_cast<long long>(st.st_mtime),
+        stats.lo, stats.hi, stats.mean, stats.histogram.size());
+    for (uint64_t value : stats.histogram) {
+        std::fprintf(file, "%llu\n", static_cast<unsigned long long>(value));
+    }
+
+    bool ok = std::ferror(file) == 0;
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(temporary.c_str(), statsFilename.c_str())) {
+        std::fprintf(stderr, "Warning: Failed to write: %s\n", statsFilename.c_str());
+        std::remove(temporary.c_str());
+    }
+}
+
+// Reads the volume's stats back from its sidecar, or computes them from
+// the freshly loaded float data and writes the sidecar
+static void xUpdateVolumeStats(const std::tuple<std::string, int> &key, const std::string &filename, const float *data, size_t count) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point before = Clock::now();
+
+    struct stat st;
+    if (stat(filename.c_str(), &st)) {
+        std::memset(&st, 0, sizeof(st));
+    }
+
+    VolumeStats stats;
+    bool cached = xReadVolumeStats(filename, st, &stats);
+    if (!cached) {
+        stats = xComputeVolumeStats(data, count, gOptions.histogramBins);
+        xWriteVolumeStats(filename, st, stats);
+    }
+
+    Clock::time_point after = Clock::now();
+    using TimeUnit = std::chrono::milliseconds;
+    size_t duration = std::chrono::duration_cast<TimeUnit>(after - before).count();
+    std::fprintf(stderr, "Stats for %s (%d): [%g, %g], mean %g, %s in %zu ms\n",
+        std::get<0>(key).c_str(), std::get<1>(key), stats.lo, stats.hi, stats.mean,
+        cached ? "read" : "computed", duration);
+
+    std::unique_lock<std::mutex> lock(gVolumeStatsMutex);
+    gVolumeStats[key] = std::move(stats);
+}
+
+// Where value from the volume's domain ends up in its stored data
+static float xStoredValue(const std::tuple<std::string, int> &key, float value) {
+    const std::string &precision = xGetPrecision(key);
+    if (precision == "float") {
+        return value;
+    }
+
+    float lo, hi;
+    std::tie(lo, hi) = xGetDomain(key);
+    return (value - lo) / (hi - lo) * xPrecisionScale(precision);
+}
+
+// Rounds to nearest even. Only used for [0, 1], so no infinities or NaNs.
+static inline uint16_t xFloatToHalf(float x) {
+    if (x < 6.103515625e-05f) {  // smallest normal half, 2^-14
+        return static_cast<uint16_t>(x * 16777216.0f + 0.5f);  // in units of 2^-24
+    }
+
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    bits += 0xfff + ((bits >> 13) & 1);
+    return static_cast<uint16_t>((((bits >> 23) - 112) << 10) | ((bits >> 13) & 0x3ff));
+}
+
+// Clamps to [0, max], written so NaN goes to 0 (std::max would pass it
+// through) and infinities to either end
+static inline float xClampStored(float x, float max) {
+    x = x > 0.0f ? x : 0.0f;
+    return x < max ? x : max;
+}
+
+template <typename T>
+static void xQuantizeChunk(const float *in, T *out, size_t count, float lo, float scale, float max) {
+    for (size_t i=0; i<count; ++i) {
+        float x = (in[i] - lo) * scale;
+        out[i] = static_cast<T>(xClampStored(x, max) + 0.5f);
+    }
+}
+
+// Maps float data onto [0, xPrecisionScale] of the reduced storage type
+// against the volume's domain. Chunks are spread over the compute threads
+// and written as plain loops the compiler vectorizes.
+static void *xQuantizeBytes(const float *in, size_t count, float lo, float hi, const std::string &precision) {
+    uint8_t *out = new uint8_t[count * xPrecisionBytes(precision)];
+    float scale = xPrecisionScale(precision) / (hi - lo);
+
+    const size_t chunk = 1UL << 20;
+    size_t nchunks = (count + chunk - 1) / chunk;
+    xParallelFor(gComputeQueue, nchunks, [&](size_t i) {
+        size_t begin = i * chunk;
+        size_t n = std::min(chunk, count - begin);
+        if (0) {
+        } else if (precision == "uchar") {
+            xQuantizeChunk(in + begin, out + begin, n, lo, scale, 255.0f);
+        } else if (precision == "ushort") {
+            xQuantizeChunk(in + begin, reinterpret_cast<uint16_t *>(out) + begin, n, lo, scale, 65535.0f);
+        } else if (precision == "half") {
+            uint16_t *half = reinterpret_cast<uint16_t *>(out) + begin;
+            for (size_t j=0; j<n; ++j) {
+                float x = (in[begin + j] - lo) * scale;
+                half[j] = xFloatToHalf(xClampStored(x, 1.0f));
+            }
+        }
+    });
+
+    return out;
+}
+
+// Values are sent as-is in response to the "status" command
+enum class LoadStatus : size_t {
+    Unknown = 0,
+    Unloaded = 1,
+    Loading = 2,
+    Ready = 3,
+    Failed = 4,
+};
+
+static WorkQueue gLoadQueue;
+static std::mutex gLoadMutex;
+static std::map<
+    std::tuple<std::string, int>,
+    std::tuple<
+        LoadStatus,
+        void *,  // data
+        size_t,  // size of data
+        size_t  // gMemory.renders when last rendered
+    >
+> gLoadState;
+
+// Downsampled copies of each loaded volume, in the same precision. Level
+// i+1 is stored at [i] and has 2^(i+1) times fewer voxels along each axis.
+struct VolumeLevel {
+    void *data;
+    int dimensions[3];
+};
+static std::map<std::tuple<std::string, int>, std::vector<VolumeLevel>> gVolumeLevels;  // guarded by gLoadMutex
+
+// The range of values in each cell of a coarse grid over a level of the
+// volume, or over its bricks. Cells share their last layer of voxels with
+// the next, so the range also covers what is interpolated between them.
+struct Macrocells {
+    int size;  // voxels along each side, without the shared layer
+    int counts[3];
+    int dimensions[3];  // of the level
+    float origin[3];  // of its first voxel
+    float spacing;
+    std::vector<float> ranges;  // lo and hi of each cell, x fastest; hi < lo if all NaN
+};
+static std::map<std::tuple<std::string, int>, std::vector<Macrocells>> gMacrocells;  // by level, guarded by gLoadMutex
+
+// The cells of a level that a transfer function or isosurfaces leave
+// anything visible in, and the box around them
+struct Occupancy {
+    bool any{false};
+    float lo[3];
+    float hi[3];
+    std::vector<bool> cells;
+    std::vector<std::array<float, 6>> boxes;  // of the visible cells
+};
+// by name, timestep, opacitymap, isosurfaces and level of detail; main thread only
+static std::map<std::tuple<std::string, int, std::string, std::vector<float>, int>, std::shared_ptr<const Occupancy>> gOccupancy;
+
+// Levels that exist for the volume, 0 being the full resolution data
+static int xLodLevels(const std::tuple<std::string, int> &key) {
+    return xIsBricked(key) ? 0 : gOptions.lodLevels;
+}
+
+static int xLevelDimension(int dimension, int lod) {
+    return std::max(1, (dimension + (1 << lod) - 1) >> lod);
+}
+
+// OSPRay objects built on loaded volumes, which go when the volume is unloaded
+// by name, timestep, brick (-1 is the whole volume) and level of detail
+static LRUCache<std::tuple<std::string, int, int, int>, OSPVolume> gVolumeCache{"volume"};
+static LRUCache<std::tuple<std::string, int, int, int>, OSPGeometry> gIsosurfaceCache{"isosurface"};
+// by name, timestep, colormap, opacitymap, isosurfaces or not, bricks and level of detail
+static LRUCache<std::tuple<std::string, int, std::string, std::string, bool, std::vector<int>, int>, OSPWorld> gWorldCache{"world"};
+
+static LoadStatus xGetLoadStatus(const std::string &name, int timestep) {
+    using Key = std::tuple<std::string, int>;
+
+    Key key{name, timestep};
+    if (!xFindVolume(key)) {
+        return LoadStatus::Unknown;
+    }
+
+    std::unique_lock<std::mutex> lock(gLoadMutex);
+    if (gLoadState.find(key) == gLoadState.end()) {
+        return LoadStatus::Unloaded;
+    }
+
+    return std::get<0>(gLoadState[key]);
+}
+
+// What a volume counts against --memory-limit
+static size_t xVolumeBytes(const std::tuple<std::string, int> &key) {
+    VolumeInfo info;
+    if (!xFindVolume(key, &info)) {
+        return 0;
+    }
+
+    int d1, d2, d3;
+    std::tie(d1, d2, d3) = std::get<1>(info);
+    // Bricks stay in the page cache, which the kernel reclaims on its own
+    if (xIsBricked(key)) {
+        return 0;
+    }
+
+    size_t count = 0;
+    for (int lod=0; lod<=xLodLevels(key); ++lod) {
+        count += static_cast<size_t>(xLevelDimension(d1, lod)) * xLevelDimension(d2, lod) * xLevelDimension(d3, lod);
+    }
+
+    return xPrecisionBytes(xGetPrecision(key)) * count;
+}
+
+// Marks the volume as rendered just now, for xReserveMemory
+static void xTouchVolume(const std::string &name, int timestep) {
+    using Key = std::tuple<std::string, int>;
+    Key key{name, timestep};
+
+    std::unique_lock<std::mutex> lock(gLoadMutex);
+    auto it = gLoadState.find(key);
+    if (it != gLoadState.end()) {
+        std::get<3>(it->second) = ++gMemory.renders;
+    }
+}
+
+// Releases everything built on the volume and frees its data. Only called
+// from the main thread between renders, so nothing can be using it.
+static void xUnloadVolume(const std::tuple<std::string, int> &key) {
+    auto matches = [&](const auto &other) {
+        return std::get<0>(other) == std::get<0>(key) && std::get<1>(other) == std::get<1>(key);
+    };
+    xCacheErase(gWorldCache, matches);
+    xCacheErase(gIsosurfaceCache, matches);
+    xCacheErase(gVolumeCache, matches);
+    for (auto it=gOccupancy.begin(); it!=gOccupancy.end(); ) {
+        it = matches(it->first) ? gOccupancy.erase(it) : std::next(it);
+    }
+
+    void *data;
+    size_t size;
+    std::vector<VolumeLevel> levels;
+    {
+        std::unique_lock<std::mutex> lock(gLoadMutex);
+        std::tie(std::ignore, data, size, std::ignore) = gLoadState[key];
+        gLoadState.erase(key);
+        levels = std::move(gVolumeLevels[key]);
+        gVolumeLevels.erase(key);
+        gMacrocells.erase(key);
+    }
+
+    // Float levels are xDownsample's own arrays, quantized ones bytes
+    const bool floatLevels = xGetPrecision(key) == "float";
+    for (const VolumeLevel &level : levels) {
+        if (floatLevels) {
+            delete[] static_cast<float *>(level.data);
+        } else {
+            delete[] static_cast<uint8_t *>(level.data);
+        }
+    }
+
+    if (0) {
+    } else if (data == nullptr) {
+    } else if (xIsBricked(key)) {
+        int rv = munmap(data, size);
+        if (rv) xDie("Failed to munmap: %p", data);
+    } else if (xGetPrecision(key) == "float") {
+        xUnloadBytes(data, size);
+    } else {
+        delete[] static_cast<uint8_t *>(data);
+    }
+    gMemory.volumeBytes -= xVolumeBytes(key);
+
+    std::fprintf(stderr, "Unloaded %s (%d), %zu MiB in use\n", std::get<0>(key).c_str(), std::get<1>(key), xMemoryInUse() >> 20);
+}
+
+// Makes room for bytes more by unloading the least recently rendered
+// volumes that are ready, then counts them as in use
+static void xReserveMemory(const std::tuple<std::string, int> &key, size_t bytes) {
+    while (gOptions.memoryLimit != 0 && xMemoryInUse() + bytes > gOptions.memoryLimit) {
+        std::tuple<std::string, int> victim;
+        bool found = false;
+        {
+            std::unique_lock<std::mutex> lock(gLoadMutex);
+            size_t oldest = SIZE_MAX;
+            for (const auto &[other, state] : gLoadState) {
+                if (other == key || std::get<0>(state) != LoadStatus::Ready) continue;
+                if (std::get<3>(state) < oldest) {
+                    oldest = std::get<3>(state);
+                    victim = other;
+                    found = true;
+                }
+            }
+        }
+
+        if (!found) {
+            std::fprintf(stderr, "Warning: Loading %s (%d) goes over the memory limit\n", std::get<0>(key).c_str(), std::get<1>(key));
+            break;
+        }
+
+        xUnloadVolume(victim);
+    }
+
+    gMemory.volumeBytes += bytes;
+}
+
+// Maps a brick file without reading any bricks, which are only paged in
+// once a render touches them. The stats come from the brick table.
+static void *xMapBricks(const std::tuple<std::string, int> &key, const std::string &filename, size_t *size) {
+    void *bytes = xMapBytes(filename, size, false);
+    if (bytes == nullptr) {
+        return nullptr;
+    }
+
+    VolumeInfo info;
+    xFindVolume(key, &info);
+    int d1, d2, d3;
+    std::tie(d1, d2, d3) = std::get<1>(info);
+
+    const BrickFileHeader *header = static_cast<const BrickFileHeader *>(bytes);
+    const BrickFileEntry *bricks = nullptr;
+    size_t count = 0;
+    const char *error = ({
+        const char *error = nullptr;
+        if (0) {
+        } else if (*size < sizeof(BrickFileHeader) || std::memcmp(header->magic, kBrickMagic, sizeof(kBrickMagic)) != 0) {
+            error = "not a brick file";
+        } else if (header->version != kBrickVersion) {
+            error = "unsupported version";
+        } else if (header->dimensions[0] != d1 || header->dimensions[1] != d2 || header->dimensions[2] != d3) {
+            error = "dimensions differ from the catalog";
+        } else if (header->brickCounts[0] < 1 || header->brickCounts[1] < 1 || header->brickCounts[2] < 1) {
+            error = "no bricks";
+        } else {
+            count = static_cast<size_t>(header->brickCounts[0]) * header->brickCounts[1] * header->brickCounts[2];
+            bricks = xGetBricks(bytes);
+            if (header->tableOffset + count * sizeof(BrickFileEntry) > *size) error = "truncated brick table";
+            for (size_t i=0; i<count && !error; ++i) {
+                size_t voxels = static_cast<size_t>(bricks[i].dimensions[0]) * bricks[i].dimensions[1] * bricks[i].dimensions[2];
+                if (bricks[i].offset + voxels * sizeof(float) > *size) error = "truncated brick";
+            }
+        }
+        error;
+    });
+    if (error) {
+        std::fprintf(stderr, "ERROR: %s: %s\n", filename.c_str(), error);
+        int rv = munmap(bytes, *size);
+        if (rv) xDie("Failed to munmap: %p", bytes);
+        return nullptr;
+    }
+
+    VolumeStats stats{ bricks[0].lo, bricks[0].hi, header->mean, {} };
+    for (size_t i=1; i<count; ++i) {
+        stats.lo = std::min(stats.lo, bricks[i].lo);
+        stats.hi = std::max(stats.hi, bricks[i].hi);
+    }
+    std::fprintf(stderr, "Stats for %s (%d): [%g, %g], mean %g, from %zu bricks\n",
+        std::get<0>(key).c_str(), std::get<1>(key), stats.lo, stats.hi, stats.mean, count);
+
+    std::unique_lock<std::mutex> lock(gVolumeStatsMutex);
+    gVolumeStats[key] = std::move(stats);
+
+    return bytes;
+}
+
+// Averages each 2x2x2 block of voxels, or what is left of one at the high
+// edges, leaving out NaNs. Slices are spread over the compute threads.
+static float *xDownsample(const float *in, const int dimensions[3], int out[3]) {
+    const int d1 = dimensions[0], d2 = dimensions[1], d3 = dimensions[2];
+    for (int i=0; i<3; ++i) out[i] = xLevelDimension(dimensions[i], 1);
+
+    float *data = new float[static_cast<size_t>(out[0]) * out[1] * out[2]];
+    xParallelFor(gComputeQueue, out[2], [&](size_t k) {
+        for (int j=0; j<out[1]; ++j) {
+            for (int i=0; i<out[0]; ++i) {
+                float sum = 0.0f;
+                int count = 0;
+                for (size_t z=2*k; z<std::min<size_t>(2*k + 2, d3); ++z) {
+                    for (int y=2*j; y<std::min(2*j + 2, d2); ++y) {
+                        for (int x=2*i; x<std::min(2*i + 2, d1); ++x) {
+                            float value = in[x + d1 * (y + d2 * z)];
+                            if (value != value) continue;
+                            sum += value;
+                            ++count;
+                        }
+                    }
+                }
+                data[i + out[0] * (j + out[1] * k)] = count ? sum / count : std::numeric_limits<float>::quiet_NaN();
+            }
+        }
+    });
+
+    return data;
+}
+
+// The --macrocell-size grid over float data of the given level of detail of
+// a volume, placed as xNewVolume places that level. Slabs of cells are
+// spread over the compute threads.
+static Macrocells xBuildMacrocells(const float *data, const int dimensions[3], const int volumeDimensions[3], int lod) {
+    Macrocells macrocells;
+    macrocells.size = gOptions.macrocellSize;
+    macrocells.spacing = static_cast<float>(1 << lod);
+    for (int k=0; k<3; ++k) {
+        macrocells.counts[k] = std::max(1, (dimensions[k] - 1 + macrocells.size - 1) / macrocells.size);
+        macrocells.dimensions[k] = dimensions[k];
+        macrocells.origin[k] = -0.5f * volumeDimensions[k] + 0.5f * (macrocells.spacing - 1.0f);
+    }
+
+    const int d1 = dimensions[0], d2 = dimensions[1], d3 = dimensions[2];
+    const int n1 = macrocells.counts[0], n2 = macrocells.counts[1];
+    macrocells.ranges.resize(2UL * n1 * n2 * macrocells.counts[2]);
+    xParallelFor(gComputeQueue, macrocells.counts[2], [&](size_t ck) {
+        const int size = macrocells.size;
+        for (int cj=0; cj<n2; ++cj) {
+            for (int ci=0; ci<n1; ++ci) {
+                float lo = std::numeric_limits<float>::infinity();
+                float hi = -std::numeric_limits<float>::infinity();
+                for (int z=ck*size; z<=std::min<int>((ck+1)*size, d3-1); ++z) {
+                    for (int y=cj*size; y<=std::min((cj+1)*size, d2-1); ++y) {
+                        const float *row = data + static_cast<size_t>(d1) * (y + static_cast<size_t>(d2) * z);
+                        for (int x=ci*size; x<=std::min((ci+1)*size, d1-1); ++x) {
+                            if (row[x] != row[x]) continue;
+                            lo = std::min(lo, row[x]);
+                            hi = std::max(hi, row[x]);
+                        }
+                    }
+                }
+                size_t cell = ci + static_cast<size_t>(n1) * (cj + static_cast<size_t>(n2) * ck);
+                macrocells.ranges[2*cell+0] = lo;
+                macrocells.ranges[2*cell+1] = hi;
+            }
+        }
+    });
+
+    return macrocells;
+}
+
+// Bricks are already cells, with their ranges in the brick table
+static Macrocells xBrickMacrocells(const void *bytes) {
+    const BrickFileHeader *header = static_cast<const BrickFileHeader *>(bytes);
+    const BrickFileEntry *entries = xGetBricks(bytes);
+
+    Macrocells macrocells;
+    macrocells.size = header->brickSize;
+    macrocells.spacing = 1.0f;
+    for (int k=0; k<3; ++k) {
+        macrocells.counts[k] = header->brickCounts[k];
+        macrocells.dimensions[k] = header->dimensions[k];
+        macrocells.origin[k] = -0.5f * header->dimensions[k];
+    }
+
+    size_t count = static_cast<size_t>(header->brickCounts[0]) * header->brickCounts[1] * header->brickCounts[2];
+    macrocells.ranges.resize(2 * count);
+    for (size_t i=0; i<count; ++i) {
+        macrocells.ranges[2*i+0] = entries[i].lo;
+        macrocells.ranges[2*i+1] = entries[i].hi;
+    }
+
+    return macrocells;
+}
+
+// Builds --lod-levels downsampled copies of the float data, each from the
+// one before, and stores them in the volume's precision. The macrocells of
+// each level are built while its float data is at hand.
+static std::vector<VolumeLevel> xBuildLevels(const std::tuple<std::string, int> &key, const float *data, const int dimensions[3], std::vector<Macrocells> &macrocells) {
+    const std::string &precision = xGetPrecision(key);
+    float lo, hi;
+    std::tie(lo, hi) = xGetDomain(key);
+
+    // Float levels are kept as downsampled; only quantized ones leave the
+    // float data to be freed
+    const bool keep = precision == "float";
+    std::vector<VolumeLevel> levels;
+    const float *in = data;
+    int inDimensions[3] = { dimensions[0], dimensions[1], dimensions[2] };
+    for (int lod=1; lod<=xLodLevels(key); ++lod) {
+        VolumeLevel level;
+        float *out = xDownsample(in, inDimensions, level.dimensions);
+        if (in != data && !keep) delete[] in;
+        in = out;
+        std::copy(level.dimensions, level.dimensions + 3, inDimensions);
+        if (gOptions.macrocellSize > 0) {
+            macrocells.push_back(xBuildMacrocells(out, level.dimensions, dimensions, lod));
+        }
+
+        size_t count = static_cast<size_t>(level.dimensions[0]) * level.dimensions[1] * level.dimensions[2];
+        level.data = keep ? static_cast<void *>(out) : xQuantizeBytes(out, count, lo, hi, precision);
+        levels.push_back(level);
+    }
+    if (in != data && !keep) delete[] in;
+
+    return levels;
+}
+
+static void xLoadVolumeBytes(const std::string &name, int timestep, const std::string &filename) {
+    using Key = std::tuple<std::string, int>;
+    Key key{name, timestep};
+
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point beforeLoad = Clock::now();
+    size_t size = 0;
+    bool bricked = xIsBricked(key);
+    void *bytes = bricked ? xMapBricks(key, filename, &size) : xLoadBytes(filename, &size);
+
+    int dimensions[3];
+    size_t count = ({
+        VolumeInfo info;
+        xFindVolume(key, &info);
+
+        std::tie(dimensions[0], dimensions[1], dimensions[2]) = std::get<1>(info);
+        static_cast<size_t>(dimensions[0]) * dimensions[1] * dimensions[2];
+    });
+    if (bytes && !bricked && size < count * sizeof(float)) {
+        std::fprintf(stderr, "ERROR: %s is %zu bytes, expected %zu\n", filename.c_str(), size, count * sizeof(float));
+        xUnloadBytes(bytes, size);
+        bytes = nullptr;
+    }
+
+    if (bytes && !bricked) {
+        xUpdateVolumeStats(key, filename, static_cast<const float *>(bytes), count);
+    }
+
+    std::vector<VolumeLevel> levels;
+    std::vector<Macrocells> macrocells;
+    if (0) {
+    } else if (!bytes || gOptions.macrocellSize <= 0) {
+    } else if (bricked) {
+        macrocells.push_back(xBrickMacrocells(bytes));
+    } else {
+        macrocells.push_back(xBuildMacrocells(static_cast<const float *>(bytes), dimensions, dimensions, 0));
+    }
+    if (bytes) {
+        levels = xBuildLevels(key, static_cast<const float *>(bytes), dimensions, macrocells);
+    }
+
+    // The float data is only needed long enough to quantize it
+    const std::string &precision = xGetPrecision(key);
+    if (bytes && precision != "float") {
+        float lo, hi;
+        std::tie(lo, hi) = xGetDomain(key);
+        void *quantized = xQuantizeBytes(static_cast<const float *>(bytes), count, lo, hi, precision);
+
+        xUnloadBytes(bytes, size);
+        bytes = quantized;
+        size = count * xPrecisionBytes(precision);
+    }
+    Clock::time_point afterLoad = Clock::now();
+
+    using TimeUnit = std::chrono::milliseconds;
+    size_t loadDuration = std::chrono::duration_cast<TimeUnit>(afterLoad - beforeLoad).count();
+    if (bytes) std::fprintf(stderr, "Loaded %s (%d) as %s in %zu ms\n", name.c_str(), timestep, precision.c_str(), loadDuration);
+    if (!bytes) gMemory.volumeBytes -= xVolumeBytes(key);
+
+    std::unique_lock<std::mutex> lock(gLoadMutex);
+    LoadStatus status = bytes ? LoadStatus::Ready : LoadStatus::Failed;
+    gVolumeLevels[key] = std::move(levels);
+    gMacrocells[key] = std::move(macrocells);
+    std::get<0>(gLoadState[key]) = status;
+    std::get<1>(gLoadState[key]) = bytes;
+    std::get<2>(gLoadState[key]) = size;
+}
+
+static void xPreloadVolume(const std::string &name, int timestep) {
+    using Key = std::tuple<std::string, int>;
+
+    Key key{name, timestep};
+    VolumeInfo info;
+    if (!xFindVolume(key, &info)) {
+        std::fprintf(stderr, "ERROR: Unknown volume! %s, %d\n", name.c_str(), timestep);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(gLoadMutex);
+        if (gLoadState.find(key) != gLoadState.end()) {
+            return;
+        }
+
+        gLoadState[key] = std::make_tuple(LoadStatus::Loading, nullptr, 0, ++gMemory.renders);
+    }
+
+    xReserveMemory(key, xVolumeBytes(key));
+
+    std::string filename;
+    std::tie(filename, std::ignore, std::ignore) = info;
+
+    xSubmit(gLoadQueue, [=]() {
+        xLoadVolumeBytes(name, timestep, filename);
+    });
+}
+
+// Returns nullptr while the volume is still being loaded in the background
+static void *xGetVolumeBytes(const std::string &name, int timestep) {
+    using Key = std::tuple<std::string, int>;
+    Key key{name, timestep};
+    VolumeInfo info;
+    if (!xFindVolume(key, &info)) {
+        return nullptr;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(gLoadMutex);
+        if (gLoadState.find(key) != gLoadState.end()) {
+            return std::get<1>(gLoadState[key]);
+        }
+
+        gLoadState[key] = std::make_tuple(LoadStatus::Loading, nullptr, 0, ++gMemory.renders);
+    }
+
+    xReserveMemory(key, xVolumeBytes(key));
+
+    // Nobody asked to preload this volume, so load it on the spot
+    std::string filename;
+    std::tie(filename, std::ignore, std::ignore) = info;
+    xLoadVolumeBytes(name, timestep, filename);
+
+    std::unique_lock<std::mutex> lock(gLoadMutex);
+    return std::get<1>(gLoadState[key]);
+}
+
+// Reads --catalog again. Volumes whose entry changed or went away are
+// unloaded so the next render picks up the new entry; all others keep
+// their data and the objects cached on them. A catalog that fails to
+// read leaves the current one in place. Returns the volumes that were
+// added or changed.
+static std::set<std::tuple<std::string, int>> xReloadCatalog() {
+    using Key = std::tuple<std::string, int>;
+
+    if (gOptions.catalog.empty()) {
+        return {};
+    }
+
+    std::map<Key, VolumeInfo> catalog;
+    if (!xReadCatalog(gOptions.catalog, catalog)) {
+        std::fprintf(stderr, "ERROR: Keeping the current catalog\n");
+        return {};
+    }
+
+    std::vector<std::tuple<Key, VolumeInfo>> stale;
+    std::set<Key> changed;
+    {
+        std::unique_lock<std::mutex> lock(gVolumesMutex);
+        for (const auto &[key, info] : volumes) {
+            auto it = catalog.find(key);
+            if (it == catalog.end() || it->second != info) {
+                stale.emplace_back(key, info);
+            }
+        }
+        for (const auto &[key, info] : catalog) {
+            auto it = volumes.find(key);
+            if (it == volumes.end() || it->second != info) {
+                changed.insert(key);
+            }
+        }
+    }
+
+    size_t unloaded = 0;
+    for (const auto &[key, info] : stale) {
+        LoadStatus status = xGetLoadStatus(std::get<0>(key), std::get<1>(key));
+        if (0) {
+        } else if (status == LoadStatus::Loading) {
+            // The load thread still reads the old entry
+            std::fprintf(stderr, "Warning: %s (%d) is loading, its catalog entry changes on a later reload\n", std::get<0>(key).c_str(), std::get<1>(key));
+            catalog[key] = info;
+            changed.erase(key);
+            continue;
+        } else if (status == LoadStatus::Ready) {
+            xUnloadVolume(key);
+            ++unloaded;
+        } else if (status == LoadStatus::Failed) {
+            std::unique_lock<std::mutex> lock(gLoadMutex);
+            gLoadState.erase(key);
+        }
+
+        std::unique_lock<std::mutex> lock(gVolumeStatsMutex);
+        gVolumeStats.erase(key);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(gVolumesMutex);
+        volumes = std::move(catalog);
+        std::fprintf(stderr, "Read %zu volumes from %s, unloaded %zu\n", volumes.size(), gOptions.catalog.c_str(), unloaded);
+    }
+
+    return changed;
+}
+
+// The volumes that can be rendered: count, then the length-prefixed name,
+// timestep and whether it is in changed for each
+static std::vector<uint8_t> xPackCatalog(const std::set<std::tuple<std::string, int>> &changed) {
+    std::vector<uint8_t> payload;
+    auto pack = [&](const auto &x) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&x);
+        payload.insert(payload.end(), bytes, bytes + sizeof(x));
+    };
+
+    std::unique_lock<std::mutex> lock(gVolumesMutex);
+    pack(static_cast<uint32_t>(volumes.size()));
+    for (const auto &[key, info] : volumes) {
+        const std::string &name = std::get<0>(key);
+        pack(static_cast<uint16_t>(name.size()));
+        payload.insert(payload.end(), name.begin(), name.end());
+        pack(static_cast<int32_t>(std::get<1>(key)));
+        pack(static_cast<uint8_t>(changed.count(key)));
+    }
+
+    return payload;
+}
+
+static OSPVolume xNewVolume(const std::string &name, int timestep, int brick, int lod) {
+    using Key = std::tuple<std::string, int>;
+
+    Key key{name, timestep};
+    VolumeInfo info;
+    if (!xFindVolume(key, &info)) {
+        std::fprintf(stderr, "ERROR: Unknown volume! %s, %d\n", name.c_str(), timestep);
+        return nullptr;
+    }
+
+    std::string filename;
+    std::tuple<float, float, float> dimensions;
+    std::tie(filename, dimensions, std::ignore) = info;
+    
+    int d1, d2, d3;
+    std::tie(d1, d2, d3) = dimensions;
+
+    const void *bytes = xGetVolumeBytes(name, timestep);
+    if (bytes == nullptr) {
+        return nullptr;
+    }
+
+    // Either the whole volume, one of its levels of detail stretched over the
+    // same space, or one brick placed where it sits within it
+    const void *voxels = bytes;
+    int n1 = d1, n2 = d2, n3 = d3;
+    float gridOrigin[3] = { -0.5f*d1, -0.5f*d2, -0.5f*d3 };
+    float gridSpacing[3] = { 1.0f, 1.0f, 1.0f };
+    if (lod > 0) {
+        VolumeLevel level = ({
+            std::unique_lock<std::mutex> lock(gLoadMutex);
+            gVolumeLevels[key].at(lod - 1);
+        });
+        voxels = level.data;
+        n1 = level.dimensions[0];
+        n2 = level.dimensions[1];
+        n3 = level.dimensions[2];
+        for (int i=0; i<3; ++i) {
+            gridSpacing[i] = static_cast<float>(1 << lod);
+            gridOrigin[i] += 0.5f * (gridSpacing[i] - 1.0f);
+        }
+    }
+    if (brick >= 0) {
+        const BrickFileEntry &entry = xGetBricks(bytes)[brick];
+        voxels = static_cast<const uint8_t *>(bytes) + entry.offset;
+        n1 = entry.dimensions[0];
+        n2 = entry.dimensions[1];
+        n3 = entry.dimensions[2];
+        for (int i=0; i<3; ++i) gridOrigin[i] += entry.origin[i];
+    }
+
+    OSPVolume volume;
+    const char *type = "structuredRegular";
+    volume = ospNewVolume(type);
+
+    OSPData data;
+    data = ({
+        OSPData data;
+        const void *sharedData = voxels;
+        OSPDataType dataType = xPrecisionDataType(xGetPrecision(key));
+        uint64_t numItems1 = n1;
+        uint64_t numItems2 = n2;
+        uint64_t numItems3 = n3;
+        data = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
+    
+        xCommit(data);
+    });
+    ospSetObject(volume, "data", data);
+    ospRelease(data);
+
+    ospSetParam(volume, "gridOrigin", OSP_VEC3F, gridOrigin);
+    ospSetParam(volume, "gridSpacing", OSP_VEC3F, gridSpacing);
+
+    float densityScale[] = { 0.1 };
+    ospSetParam(volume, "densityScale", OSP_FLOAT, densityScale);
+
+    // float gridSpacing[3] = { 1.0f/d1, 1.0f/d2, 1.0f/d3 };
+    // ospSetParam(volume, "gridSpacing", OSP_VEC3F, gridSpacing);
+
+    // int cellCentered = 0;
+    // ospSetParam(volume, "cellCentered", OSP_BOOL, &cellCentered);
+
+    return volume;
+}
+
+static std::map<std::string, std::vector<float>> colorMaps{
+#   include "detail/colormaps.h"
+};
+
+static OSPData xNewColorMap(const std::string &name) {
+    if (colorMaps.find(name) == colorMaps.end()) {
+        std::fprintf(stderr, "ERROR: Colormap not found: %s\n", name.c_str());
+        return nullptr;
+    }
+
+    OSPData data;
+    const void *sharedData = colorMaps[name].data();
+    OSPDataType dataType = OSP_VEC3F;
+    uint64_t numItems1 = colorMaps[name].size() / 3;
+    uint64_t numItems2 = 1;
+    uint64_t numItems3 = 1;
+    data = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
+
+    return data;
+}
+
+static OSPData xGetColorMap(const std::string &name) {
+    using Key = std::tuple<std::string>;
+    static LRUCache<Key, OSPData> cache{"colormap"};
+
+    Key key{name};
+    OSPData data = xCacheGet(cache, key);
+    if (data == nullptr) {
+        data = xNewColorMap(name);
+        if (data == nullptr) {
+            return nullptr;
+        }
+
+        size_t bytes = colorMaps[name].size() * sizeof(float);
+        xCachePut(cache, key, data, bytes);
+    }
+
+    return data;
+}
+
+static std::map<std::string, std::vector<float>> opacityMaps{
+#   include "detail/opacitymaps.h"
+};
+
+static OSPData xNewOpacityMap(const std::string &name) {
+    if (opacityMaps.find(name) == opacityMaps.end()) {
+        std::fprintf(stderr, "ERROR: Opacity map not found: %s\n", name.c_str());
+        return nullptr;
+    }
+
+    OSPData data;
+    const void *sharedData = opacityMaps[name].data();
+    OSPDataType dataType = OSP_FLOAT;
+    uint64_t numItems1 = opacityMaps[name].size();
+    uint64_t numItems2 = 1;
+    uint64_t numItems3 = 1;
+    data = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
+
+    return data;
+}
+
+static OSPData xGetOpacityMap(const std::string &name) {
+    using Key = std::tuple<std::string>;
+    static LRUCache<Key, OSPData> cache{"opacitymap"};
+
+    Key key{name};
+    OSPData data = xCacheGet(cache, key);
+    if (data == nullptr) {
+        data = xNewOpacityMap(name);
+        if (data == nullptr) {
+            return nullptr;
+        }
+
+        size_t bytes = opacityMaps[name].size() * sizeof(float);
+        xCachePut(cache, key, data, bytes);
+    }
+
+    return data;
+}
+
+static OSPTransferFunction xNewTransferFunction(
+    const std::string &colorName,
+    const std::string &opacityName
+) {
+    OSPTransferFunction transferFunction;
+    const char *type = "piecewiseLinear";
+    transferFunction = ospNewTransferFunction(type);
+
+    OSPData color;
+    color = ({
+        OSPData data;
+        data = xGetColorMap(colorName);
+        if (data == nullptr) {
+            return nullptr;
+        }
+        
+        xCommit(data);
+    });
+    ospSetObject(transferFunction, "color", color);
+
+    OSPData opacity;
+    opacity = ({
+        OSPData data;
+        data = xGetOpacityMap(opacityName);
+        if (data == nullptr) {
+            return nullptr;
+        }
+        
+        xCommit(data);
+    });
+    ospSetObject(transferFunction, "opacity", opacity);
+
+    return transferFunction;
+}
+
+static OSPVolume xGetVolume(const std::string &name, int timestep, int brick, int lod) {
+    using Key = std::tuple<std::string, int, int, int>;
+
+    Key key{name, timestep, brick, lod};
+    OSPVolume volume = xCacheGet(gVolumeCache, key);
+    if (volume == nullptr) {
+        volume = xNewVolume(name, timestep, brick, lod);
+        if (volume == nullptr) {
+            return nullptr;
+        }
+
+        size_t bytes = ({
+            std::tuple<std::string, int> volumeKey{name, timestep};
+            VolumeInfo info;
+            xFindVolume(volumeKey, &info);
+
+            int d1, d2, d3;
+            std::tie(d1, d2, d3) = std::get<1>(info);
+            size_t count = static_cast<size_t>(xLevelDimension(d1, lod)) * xLevelDimension(d2, lod) * xLevelDimension(d3, lod);
+            if (brick >= 0) {
+                const BrickFileEntry &entry = xGetBricks(xGetVolumeBytes(name, timestep))[brick];
+                count = static_cast<size_t>(entry.dimensions[0]) * entry.dimensions[1] * entry.dimensions[2];
+            }
+            xPrecisionBytes(xGetPrecision(volumeKey)) * count;
+        });
+        xCachePut(gVolumeCache, key, volume, bytes);
+    }
+
+    return volume;
+}
+
+static OSPGeometry xNewIsosurface(
+    const std::string &volumeName,
+    int timestep,
+    int brick,
+    int lod
+) {
+    OSPGeometry isosurface;
+    isosurface = ({
+        OSPGeometry geometry;
+        const char *type = "isosurface";
+        geometry = ospNewGeometry(type);
+    });
+
+    OSPVolume volume;
+    volume = ({
+        OSPVolume volume;
+        volume = xGetVolume(volumeName, timestep, brick, lod);
+        if (volume == nullptr) {
+            ospRelease(isosurface);
+            return nullptr;
+        }
+
+        xCommit(volume);
+    });
+    ospSetObject(isosurface, "volume", volume);
+
+    return isosurface;
+}
+
+static OSPGeometry xGetIsosurface(
+    const std::string &volumeName,
+    int timestep,
+    int brick,
+    int lod,
+    const std::vector<float> &isosurfaceValues
+) {
+    using Key = std::tuple<std::string, int>;
+    Key key{volumeName, timestep};
+
+    OSPGeometry isosurface = xCacheGet(gIsosurfaceCache, std::make_tuple(volumeName, timestep, brick, lod));
+    if (isosurface == nullptr) {
+        isosurface = xNewIsosurface(volumeName, timestep, brick, lod);
+        if (isosurface == nullptr) {
+            return nullptr;
+        }
+
+        xCachePut(gIsosurfaceCache, std::make_tuple(volumeName, timestep, brick, lod), isosurface, 0);
+    }
+
+    OSPData isovalue;
+    isovalue = ({
+        std::vector<float> values(isosurfaceValues.size());
+        for (size_t i=0, n=values.size(); i<n; ++i) {
+            values[i] = xStoredValue(key, isosurfaceValues[i]);
+        }
+
+        OSPData shared;
+        const void *sharedData = values.data();
+        OSPDataType dataType = OSP_FLOAT;
+        uint64_t numItems1 = values.size();
+        uint64_t numItems2 = 1;
+        uint64_t numItems3 = 1;
+        shared = xNewSharedData(sharedData, dataType, numItems1, numItems2, numItems3);
+
+        // values goes out of scope, so the geometry gets its own copy
+        OSPData data;
+        data = ospNewData(dataType, numItems1, numItems2, numItems3);
+        ospCopyData(shared, data, 0, 0, 0);
+        ospRelease(shared);
+
+        xCommit(data);
     });
     ospSetObject(isosurface, "isovalue", isovalue);
     ospRelease(isovalue);
 
-    return isosurface;
+    return isosurface;
+}
+
+static OSPGeometricModel xNewIsosurfaceModel(
+    const std::string &volumeName,
+    int timestep,
+    int brick,
+    int lod,
+    const std::vector<float> &isosurfaceValues
+) {
+    OSPGeometricModel model;
+    model = ospNewGeometricModel(nullptr);
+
+    OSPGeometry geometry = ({
+        OSPGeometry isosurface;
+        isosurface = xGetIsosurface(volumeName, timestep, brick, lod, isosurfaceValues);
+        if (isosurface == nullptr) {
+            return nullptr;
+        }
+
+        xCommit(isosurface);
+    });
+    ospSetObject(model, "geometry", geometry);
+
+    return model;
+}
+
+
+// Shared by every brick of the volume
+static OSPTransferFunction xNewVolumeTransferFunction(
+    const std::string &volumeName,
+    int timestep,
+    const std::string &colorMapName,
+    const std::string &opacityMapName
+) {
+    OSPTransferFunction transferFunction;
+    transferFunction = xNewTransferFunction(colorMapName, opacityMapName);
+    if (transferFunction == nullptr) {
+        return nullptr;
+    }
+
+    using Key = std::tuple<std::string, int>;
+    Key key{volumeName, timestep};
+
+    float lo, hi;
+    std::tie(lo, hi) = xGetDomain(key);
+
+    float value[2] = { xStoredValue(key, lo), xStoredValue(key, hi) };
+    ospSetParam(transferFunction, "value", OSP_BOX1F, value);
+
+    return xCommit(transferFunction);
+}
+
+static OSPVolumetricModel xNewVolumetricModel(
+    const std::string &volumeName,
+    int timestep,
+    int brick,
+    int lod,
+    OSPTransferFunction transferFunction
+) {
+    OSPVolumetricModel model;
+    model = ospNewVolumetricModel(nullptr);
+
+    OSPVolume volume;
+    volume = ({
+        OSPVolume volume;
+        volume = xGetVolume(volumeName, timestep, brick, lod);
+        if (volume == nullptr) {
+            return nullptr;
+        }
+
+        xCommit(volume);
+    });
+    ospSetObject(model, "volume", volume);
+    // ospRelease(volume);
+
+    ospSetObject(model, "transferFunction", transferFunction);
+
+    return model;
+}
+
+static void xErrorCallback(void *userData, OSPError error, const char *errorDetails) {
+    (void)userData;
+
+    std::fprintf(stderr, "OSPError (%d): %s\n", (int)error, errorDetails);
+}
+
+static void xStatusCallback(void *userData, const char *messageText) {
+    (void)userData;
+
+    std::fprintf(stderr, "OSPStatus: %s\n", messageText);
+}
+
+// Sets an array of objects and gives up the references to them
+static void xSetObjectArray(OSPObject object, const char *name, OSPDataType type, const std::vector<OSPObject> &objects) {
+    if (objects.empty()) {
+        return;
+    }
+
+    OSPData data;
+    data = ({
+        OSPData shared;
+        const void *sharedData = objects.data();
+        uint64_t numItems1 = objects.size();
+        uint64_t numItems2 = 1;
+        uint64_t numItems3 = 1;
+        shared = xNewSharedData(sharedData, type, numItems1, numItems2, numItems3);
+
+        OSPData data;
+        data = ospNewData(type, numItems1, numItems2, numItems3);
+        ospCopyData(shared, data, 0, 0, 0);
+        ospRelease(shared);
+
+        xCommit(data);
+    });
+    ospSetObject(object, name, data);
+    ospRelease(data);
+
+    for (OSPObject x : objects) {
+        ospRelease(x);
+    }
+}
+
+static OSPWorld xNewWorld(
+    const std::string &volumeName,
+    int timestep,
+    const std::string &colorMapName,
+    const std::string &opacityMapName,
+    const std::vector<float> &isosurfaceValues,
+    const std::vector<int> &bricks,
+    int lod
+) {
+    OSPWorld world;
+    world = ospNewWorld();
+
+    OSPInstance instance;
+    instance = ({
+        OSPInstance instance;
+        instance = ospNewInstance(nullptr);
+
+        OSPGroup group;
+        group = ({
+            OSPGroup group;
+            group = ospNewGroup();
+
+            if (isosurfaceValues.empty()) {
+                OSPTransferFunction transferFunction;
+                transferFunction = xNewVolumeTransferFunction(volumeName, timestep, colorMapName, opacityMapName);
+                if (transferFunction == nullptr) {
+                    return nullptr;
+                }
+
+                std::vector<OSPObject> volumes;
+                for (int brick : bricks) {
+                    OSPVolumetricModel volume;
+                    volume = ({
+                        OSPVolumetricModel model;
+                        model = xNewVolumetricModel(volumeName, timestep, brick, lod, transferFunction);
+                        if (model == nullptr) {
+                            return nullptr;
+                        }
+
+                        xCommit(model);
+                    });
+                    volumes.push_back(volume);
+                }
+                xSetObjectArray(group, "volume", OSP_VOLUMETRIC_MODEL, volumes);
+                ospRelease(transferFunction);
+            
+            } else {
+                OSPMaterial material;
+                material = ({
+                    OSPMaterial material;
+                    const char *dummy = nullptr;
+                    const char *type = "obj";
+                    material = ospNewMaterial(dummy, type);
+
+                    xCommit(material);
+                });
+
+                std::vector<OSPObject> geometries;
+                for (int brick : bricks) {
+                    OSPGeometricModel geometry;
+                    geometry = ({
+                        OSPGeometricModel model;
+                        model = xNewIsosurfaceModel(volumeName, timestep, brick, lod, isosurfaceValues);
+                        if (model == nullptr) {
+                            return nullptr;
+                        }
+
+                        ospSetObject(model, "material", material);
+
+                        xCommit(model);
+                    });
+                    geometries.push_back(geometry);
+                }
+                xSetObjectArray(group, "geometry", OSP_GEOMETRIC_MODEL, geometries);
+                ospRelease(material);
+
+            }
+
+            xCommit(group);
+        });
+        ospSetObject(instance, "group", group);
+        ospRelease(group);
+
+        xCommit(instance);
+    });
+    ospSetObjectAsData(world, "instance", OSP_INSTANCE, instance);
+    ospRelease(instance);
+
+    return world;
+}
+
+// The camera of the next render, from xCommandCamera
+static struct {
+    float position[3]{ 0.0f, 0.0f, 0.0f };
+    float up[3]{ 0.0f, 1.0f, 0.0f };
+    float direction[3]{ 0.0f, 0.0f, -1.0f };
+    float imageStart[2]{ 0.0f, 0.0f };
+    float imageEnd[2]{ 1.0f, 1.0f };
+} gView;
+
+// Inward facing planes through origin that bound what the camera sees of
+// [imageStart, imageEnd], plus the plane it looks out of
+struct Frustum {
+    float origin[3];
+    float normals[5][3];
+};
+
+static void xCross(const float a[3], const float b[3], float out[3]) {
+    out[0] = a[1]*b[2] - a[2]*b[1];
+    out[1] = a[2]*b[0] - a[0]*b[2];
+    out[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+static float xDot(const float a[3], const float b[3]) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+static void xNormalize(float a[3]) {
+    float length = std::sqrt(xDot(a, a));
+    if (length > 0.0f) for (int i=0; i<3; ++i) a[i] /= length;
+}
+
+// Uses the perspective camera's defaults, which xGetCamera leaves alone:
+// a fovy of 60 degrees and an aspect of 1
+static Frustum xViewFrustum(const float imageStart[2], const float imageEnd[2]) {
+    Frustum frustum;
+    std::copy(gView.position, gView.position + 3, frustum.origin);
+
+    float direction[3], right[3], up[3];
+    std::copy(gView.direction, gView.direction + 3, direction);
+    xNormalize(direction);
+    xCross(direction, gView.up, right);
+    xNormalize(right);
+    xCross(right, direction, up);
+
+    const float scale = 2.0f * std::tan(0.5f * 60.0f * static_cast<float>(M_PI) / 180.0f);
+    const float screen[4][2] = {
+        { imageStart[0], imageStart[1] },
+        { imageEnd[0], imageStart[1] },
+        { imageEnd[0], imageEnd[1] },
+        { imageStart[0], imageEnd[1] },
+    };
+
+    float corners[4][3], center[3]{ 0.0f, 0.0f, 0.0f };
+    for (int i=0; i<4; ++i) {
+        for (int k=0; k<3; ++k) {
+            corners[i][k] = direction[k] + (screen[i][0] - 0.5f) * scale * right[k] + (screen[i][1] - 0.5f) * scale * up[k];
+            center[k] += 0.25f * corners[i][k];
+        }
+    }
+
+    for (int i=0; i<4; ++i) {
+        float *normal = frustum.normals[i];
+        xCross(corners[i], corners[(i + 1) % 4], normal);
+        if (xDot(normal, center) < 0.0f) for (int k=0; k<3; ++k) normal[k] = -normal[k];
+    }
+    std::copy(direction, direction + 3, frustum.normals[4]);
+
+    return frustum;
+}
+
+// Conservative: a box near a corner of the frustum may pass without
+// actually being in view
+static bool xBoxInFrustum(const Frustum &frustum, const float lo[3], const float hi[3]) {
+    for (const float *normal : frustum.normals) {
+        float corner[3];
+        for (int k=0; k<3; ++k) {
+            corner[k] = (normal[k] >= 0.0f ? hi[k] : lo[k]) - frustum.origin[k];
+        }
+        if (xDot(normal, corner) < 0.0f) return false;
+    }
+
+    return true;
+}
+
+// What the next render shows, from xCommandWorld and xCommandRenderer, so
+// tiles that cannot show the volume skip rendering and encoding
+static struct {
+    bool hasBounds{false};  // only when there is a world to render
+    float lo[3];
+    float hi[3];
+    std::shared_ptr<const Occupancy> occupancy;  // when the volume has macrocells
+    float backgroundColor[4];
+} gScene;
+
+// Whether an opacity map leaves every value in [lo, hi] fully transparent.
+// The map is spread evenly over the domain, linear between its entries and
+// clamped beyond it.
+static bool xTransparent(const std::vector<float> &opacities, float domainLo, float domainHi, float lo, float hi) {
+    if (!(lo <= hi)) {
+        return true;  // nothing but NaNs
+    }
+
+    float last = static_cast<float>(opacities.size() - 1);
+    float scale = last / std::max(domainHi - domainLo, std::numeric_limits<float>::min());
+    size_t i0 = static_cast<size_t>(std::clamp(std::floor((lo - domainLo) * scale), 0.0f, last));
+    size_t i1 = static_cast<size_t>(std::clamp(std::ceil((hi - domainLo) * scale), 0.0f, last));
+    for (size_t i=i0; i<=i1; ++i) {
+        if (opacities[i] > 0.0f) return false;
+    }
+
+    return true;
+}
+
+// Which macrocells of the level show anything, either through the opacity
+// map or by spanning one of the isovalues. Returns nullptr while the volume
+// is loading or when it has no macrocells.
+static std::shared_ptr<const Occupancy> xGetOccupancy(
+    const std::string &volumeName,
+    int timestep,
+    const std::string &opacityMapName,
+    const std::vector<float> &isosurfaceValues,
+    int lod
+) {
+    using Key = std::tuple<std::string, int, std::string, std::vector<float>, int>;
+    Key key{volumeName, timestep, isosurfaceValues.empty() ? opacityMapName : "", isosurfaceValues, lod};
+
+    auto it = gOccupancy.find(key);
+    if (it != gOccupancy.end()) {
+        return it->second;
+    }
+
+    std::tuple<std::string, int> volumeKey{volumeName, timestep};
+    if (xGetVolumeBytes(volumeName, timestep) == nullptr) {
+        return nullptr;
+    }
+    if (isosurfaceValues.empty() && opacityMaps.find(opacityMapName) == opacityMaps.end()) {
+        return nullptr;
+    }
+
+    // Only ever replaced by unloading the volume, on this thread
+    const Macrocells *macrocells = ({
+        std::unique_lock<std::mutex> lock(gLoadMutex);
+        auto it = gMacrocells.find(volumeKey);
+        it == gMacrocells.end() || static_cast<size_t>(lod) >= it->second.size() ? nullptr : &it->second[lod];
+    });
+    if (macrocells == nullptr) {
+        return nullptr;
+    }
+
+    float domainLo, domainHi;
+    std::tie(domainLo, domainHi) = xGetDomain(volumeKey);
+
+    // Values of reduced precision volumes are off by up to half a step
+    const std::string &precision = xGetPrecision(volumeKey);
+    float margin = precision == "float" ? 0.0f : 0.5f * (domainHi - domainLo) / (precision == "half" ? 2048.0f : xPrecisionScale(precision));
+
+    auto occupancy = std::make_shared<Occupancy>();
+    const int n1 = macrocells->counts[0], n2 = macrocells->counts[1], n3 = macrocells->counts[2];
+    occupancy->cells.resize(static_cast<size_t>(n1) * n2 * n3);
+    for (int ck=0; ck<n3; ++ck) {
+        for (int cj=0; cj<n2; ++cj) {
+            for (int ci=0; ci<n1; ++ci) {
+                size_t cell = ci + static_cast<size_t>(n1) * (cj + static_cast<size_t>(n2) * ck);
+                float lo = macrocells->ranges[2*cell+0];
+                float hi = macrocells->ranges[2*cell+1];
+
+                bool visible = isosurfaceValues.empty() && !xTransparent(opacityMaps[opacityMapName], domainLo, domainHi, lo - margin, hi + margin);
+                for (float value : isosurfaceValues) {
+                    visible = visible || (lo - margin <= value && value <= hi + margin);
+                }
+                if (!visible) continue;
+
+                int c[3] = { ci, cj, ck };
+                std::array<float, 6> box;
+                for (int k=0; k<3; ++k) {
+                    int first = c[k] * macrocells->size;
+                    int last = std::min(first + macrocells->size, macrocells->dimensions[k] - 1);
+                    box[k] = macrocells->origin[k] + first * macrocells->spacing;
+                    box[3+k] = macrocells->origin[k] + last * macrocells->spacing;
+
+                    occupancy->lo[k] = occupancy->any ? std::min(occupancy->lo[k], box[k]) : box[k];
+                    occupancy->hi[k] = occupancy->any ? std::max(occupancy->hi[k], box[3+k]) : box[3+k];
+                }
+                occupancy->any = true;
+                occupancy->cells[cell] = true;
+                occupancy->boxes.push_back(box);
+            }
+        }
+    }
+
+    gOccupancy.emplace(key, occupancy);
+    return occupancy;
+}
+
+// Which parts of the volume a world is built from: -1 for the whole volume,
+// or the bricks of a bricked volume that are in view and show anything:
+// not fully transparent, or for isosurfaces, spanning one of the
+// isovalues. Only the chosen bricks are ever read.
+static bool xSelectBricks(
+    const std::string &volumeName,
+    int timestep,
+    const std::vector<float> &isosurfaceValues,
+    const Occupancy *occupancy,
+    std::vector<int> &bricks
+) {
+    using Key = std::tuple<std::string, int>;
+    Key key{volumeName, timestep};
+
+    if (!xIsBricked(key)) {
+        bricks.assign(1, -1);
+        return true;
+    }
+
+    const void *bytes = xGetVolumeBytes(volumeName, timestep);
+    if (bytes == nullptr) {
+        return false;
+    }
+
+    const BrickFileHeader *header = static_cast<const BrickFileHeader *>(bytes);
+    const BrickFileEntry *entries = xGetBricks(bytes);
+    size_t count = static_cast<size_t>(header->brickCounts[0]) * header->brickCounts[1] * header->brickCounts[2];
+
+    Frustum frustum = xViewFrustum(gView.imageStart, gView.imageEnd);
+    for (size_t i=0; i<count; ++i) {
+        const BrickFileEntry &entry = entries[i];
+
+        float lo[3], hi[3];
+        for (int k=0; k<3; ++k) {
+            lo[k] = -0.5f * header->dimensions[k] + entry.origin[k];
+            hi[k] = lo[k] + entry.dimensions[k] - 1;
+        }
+        if (!xBoxInFrustum(frustum, lo, hi)) continue;
+
+        bool visible = isosurfaceValues.empty();
+        for (float value : isosurfaceValues) {
+            visible = visible || (entry.lo <= value && value <= entry.hi);
+        }
+        if (occupancy != nullptr) visible = occupancy->cells[i];
+        if (!visible) continue;
+
+        bricks.push_back(static_cast<int>(i));
+    }
+
+    return true;
+}
+
+static OSPWorld xGetWorld(
+    const std::string &volumeName,
+    int timestep,
+    const std::string &colorMapName,
+    const std::string &opacityMapName,
+    const std::vector<float> &isosurfaceValues,
+    int lod
+) {
+    using Key = std::tuple<std::string, int, std::string, std::string, bool, std::vector<int>, int>;
+
+    std::shared_ptr<const Occupancy> occupancy = xGetOccupancy(volumeName, timestep, opacityMapName, isosurfaceValues, lod);
+
+    std::vector<int> bricks;
+    if (!xSelectBricks(volumeName, timestep, isosurfaceValues, occupancy.get(), bricks)) {
+        return nullptr;
+    }
+
+    Key key{volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues.empty(), bricks, lod};
+    OSPWorld world = xCacheGet(gWorldCache, key);
+    if (world == nullptr) {
+        world = xNewWorld(volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues, bricks, lod);
+        if (world == nullptr) {
+            return nullptr;
+        }
+
+        xCachePut(gWorldCache, key, world, 0);
+    }
+
+    return world;
+}
+
+
+static OSPFrameBuffer xNewFrameBuffer(int width, int height, bool variance) {
+    OSPFrameBuffer frameBuffer;
+    OSPFrameBufferFormat format = OSP_FB_SRGBA;
+    uint32_t channels = OSP_FB_COLOR | OSP_FB_ACCUM;
+    if (variance) channels |= OSP_FB_VARIANCE;
+    frameBuffer = ospNewFrameBuffer(width, height, format, channels);
+
+    return frameBuffer;
+}
+
+// Each pipeline slot gets its own frame buffer so one can be encoded while
+// the next frame renders into another
+// Slot -1 is for progressive renders, which also need a variance estimate
+static OSPFrameBuffer xGetFrameBuffer(int width, int height, int slot) {
+    using Key = std::tuple<int, int, int>;
+    static LRUCache<Key, OSPFrameBuffer> cache{"framebuffer", &gMemory.frameBufferBytes};
+    Key key{width, height, slot};
+
+    OSPFrameBuffer frameBuffer = xCacheGet(cache, key);
+    if (frameBuffer == nullptr) {
+        frameBuffer = xNewFrameBuffer(width, height, slot < 0);
+
+        // 8-bit color plus the float4 accumulation and variance buffers
+        size_t bytes = (4 + 16 + (slot < 0 ? 16 : 0)) * static_cast<size_t>(width) * height;
+        xCachePut(cache, key, frameBuffer, bytes);
+    }
+
+    return frameBuffer;
+}
+
+static OSPCamera xNewCamera(
+    const std::string &type
+) {
+    OSPCamera camera;
+    camera = ospNewCamera(type.c_str());
+
+    return camera;
 }
 
-static OSPGeometricModel xNewIsosurfaceModel(
-    const std::string &volumeName,
-    int timestep,
-    const std::vector<float> &isosurfaceValues
+static OSPCamera xGetCamera(
+    const std::string &type,
+    float position[3],
+    float up[3],
+    float direction[3],
+    float imageStart[2],
+    float imageEnd[2]
 ) {
-    OSPGeometricModel model;
-    model = ospNewGeometricModel(nullptr);
+    using Key = std::tuple<std::string>;
+    static LRUCache<Key, OSPCamera> cache{"camera"};
 
-    OSPGeometry geometry = ({
-        OSPGeometry isosurface;
-        isosurface = xGetIsosurface(volumeName, timestep, isosurfaceValues);
+    Key key = std::make_tuple(type);
+    OSPCamera camera = xCacheGet(cache, key);
+    if (camera == nullptr) {
+        camera = xNewCamera(type);
 
-        xCommit(isosurface);
-    });
-    ospSetObject(model, "geometry", geometry);
+        xCachePut(cache, key, camera, 0);
+    }
 
-    return model;
+    ospSetParam(camera, "position", OSP_VEC3F, position);
+    ospSetParam(camera, "up", OSP_VEC3F, up);
+    ospSetParam(camera, "direction", OSP_VEC3F, direction);
+    ospSetParam(camera, "imageStart", OSP_VEC2F, imageStart);
+    ospSetParam(camera, "imageEnd", OSP_VEC2F, imageEnd);
+
+    return camera;
 }
 
+// What each request may trade for speed. The defaults are what every
+// render used before requests could choose, and OSPRay's own defaults.
+struct RendererQuality {
+    std::string type{"ao"};  // ao, scivis or pathtracer
+    int pixelSamples{2};
+    int aoSamples{1};  // ignored by the pathtracer
+    float volumeSamplingRate{1.0f};  // ignored by the pathtracer
+    int maxPathLength{20};
+};
 
-static OSPVolumetricModel xNewVolumetricModel(
+static bool xValidRendererQuality(const RendererQuality &quality) {
+    if (quality.type != "ao" && quality.type != "scivis" && quality.type != "pathtracer") return false;
+    if (quality.pixelSamples < 1 || quality.aoSamples < 0 || quality.maxPathLength < 0) return false;
+    if (!(quality.volumeSamplingRate > 0.0f)) return false;
+    return true;
+}
+
+static OSPRenderer xNewRenderer(const RendererQuality &quality) {
+    OSPRenderer renderer;
+    renderer = ospNewRenderer(quality.type.c_str());
+
+    int pixelSamples[] = { quality.pixelSamples };
+    ospSetParam(renderer, "pixelSamples", OSP_INT, pixelSamples);
+
+    int maxPathLength[] = { quality.maxPathLength };
+    ospSetParam(renderer, "maxPathLength", OSP_INT, maxPathLength);
+
+    if (quality.type != "pathtracer") {
+        int aoSamples[] = { quality.aoSamples };
+        ospSetParam(renderer, "aoSamples", OSP_INT, aoSamples);
+
+        float volumeSamplingRate[] = { quality.volumeSamplingRate };
+        ospSetParam(renderer, "volumeSamplingRate", OSP_FLOAT, volumeSamplingRate);
+    }
+
+    return renderer;
+}
+
+static OSPRenderer xGetRenderer(
+    const RendererQuality &quality,
+    float backgroundColor[4]
+) {
+    using Key = std::tuple<std::string, int, int, float, int>;
+    static LRUCache<Key, OSPRenderer> cache{"renderer"};
+
+    Key key{quality.type, quality.pixelSamples, quality.aoSamples, quality.volumeSamplingRate, quality.maxPathLength};
+    OSPRenderer renderer = xCacheGet(cache, key);
+    if (renderer == nullptr) {
+        renderer = xNewRenderer(quality);
+
+        xCachePut(cache, key, renderer, 0);
+    }
+
+    ospSetParam(renderer, "backgroundColor", OSP_VEC4F, backgroundColor);
+
+    return renderer;
+}
+
+// A negative lod picks the coarsest level that still has about a voxel per
+// pixel, as if the volume filled the view, given the width of the image
+// rendered of [imageStart, imageEnd]
+static int xSelectLod(const std::tuple<std::string, int> &key, int lod, int width) {
+    int levels = xLodLevels(key);
+    if (lod >= 0) {
+        return std::min(lod, levels);
+    }
+
+    VolumeInfo info;
+    if (!xFindVolume(key, &info)) {
+        return 0;
+    }
+
+    int d1, d2, d3;
+    std::tie(d1, d2, d3) = std::get<1>(info);
+    float pixels = width / std::max(std::abs(gView.imageEnd[0] - gView.imageStart[0]), 1e-6f);
+    float voxelsPerPixel = std::max({ d1, d2, d3 }) / pixels;
+
+    lod = 0;
+    while (lod < levels && voxelsPerPixel >= 2.0f) {
+        voxelsPerPixel /= 2.0f;
+        ++lod;
+    }
+
+    return lod;
+}
+
+static OSPWorld xCommandWorld(
     const std::string &volumeName,
     int timestep,
     const std::string &colorMapName,
-    const std::string &opacityMapName
+    const std::string &opacityMapName,
+    const std::vector<float> &isosurfaceValues,
+    int lod,
+    int width
 ) {
-    OSPVolumetricModel model;
-    model = ospNewVolumetricModel(nullptr);
+    xTouchVolume(volumeName, timestep);
+
+    lod = xSelectLod(std::make_tuple(volumeName, timestep), lod, width);
+
+    OSPWorld world;
+    world = xGetWorld(volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues, lod);
+
+    // The box around what shows of the volume, or without macrocells, the
+    // volume's box widened for a level of detail's coarser grid
+    gScene.hasBounds = world != nullptr;
+    gScene.occupancy = world != nullptr ? xGetOccupancy(volumeName, timestep, opacityMapName, isosurfaceValues, lod) : nullptr;
+    VolumeInfo info;
+    if (0) {
+    } else if (gScene.occupancy != nullptr) {
+        std::copy(gScene.occupancy->lo, gScene.occupancy->lo + 3, gScene.lo);
+        std::copy(gScene.occupancy->hi, gScene.occupancy->hi + 3, gScene.hi);
+    } else if (world != nullptr && xFindVolume(std::make_tuple(volumeName, timestep), &info)) {
+        int d[3];
+        std::tie(d[0], d[1], d[2]) = std::get<1>(info);
+        for (int k=0; k<3; ++k) {
+            gScene.lo[k] = -0.5f * d[k];
+            gScene.hi[k] = gScene.lo[k] + d[k] - 1 + (1 << lod);
+        }
+    }
+
+    if (world == nullptr) {
+        // Either still loading or failed: "render" answers with an empty image
+        std::fprintf(stderr, "world is null\n");
+        return nullptr;
+    }
+
+    return xCommit(world);
+}
+
+static OSPCamera xCommandCamera(
+    float position[3],
+    float up[3],
+    float direction[3],
+    float imageStart[2],
+    float imageEnd[2]
+) {
+    std::copy(position, position + 3, gView.position);
+    std::copy(up, up + 3, gView.up);
+    std::copy(direction, direction + 3, gView.direction);
+    std::copy(imageStart, imageStart + 2, gView.imageStart);
+    std::copy(imageEnd, imageEnd + 2, gView.imageEnd);
+
+    OSPCamera camera;
+    const char *type = "perspective";
+    camera = xGetCamera(type, position, up, direction, imageStart, imageEnd);
+
+    return xCommit(camera);
+}
+
+static OSPRenderer xCommandRenderer(
+    float backgroundColor[4],
+    RendererQuality quality
+) {
+    if (!xValidRendererQuality(quality)) {
+        std::fprintf(stderr, "ERROR: Bad renderer quality: %s, %d samples, %d ao samples, sampling rate %g, path length %d\n",
+            quality.type.c_str(), quality.pixelSamples, quality.aoSamples, quality.volumeSamplingRate, quality.maxPathLength);
+        quality = RendererQuality{};
+    }
+
+    std::copy(backgroundColor, backgroundColor + 4, gScene.backgroundColor);
+
+    OSPRenderer renderer;
+    renderer = xGetRenderer(quality, backgroundColor);
+
+    return xCommit(renderer);
+}
+
+// A rectangle of the frame buffer to encode as its own image, in pixels
+// from the top left
+struct ImageRegion {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+struct EncodedImage {
+    size_t length;
+    const void *data;
+};
+
+struct RenderResult {
+    size_t renderDuration;
+    size_t encodeDuration;
+    std::vector<EncodedImage> images;  // one per region, all empty if nothing was rendered
+    size_t frame{1};  // frames accumulated into the images
+    bool last{true};  // whether more refined images follow for the same render
+    bool complete{true};  // whether the images are at full quality, false if interrupted early
+};
+
+// Renders one frame after another into the same frame buffer and sends
+// the images after each. Callers pick a renderer with one pixel sample, so
+// the first image is as cheap as it gets. Stops after frames
+// frames, once the variance estimate drops below variance, or as soon as
+// interrupted says another request is waiting.
+struct Progressive {
+    int frames{1};  // 1 renders a single frame as usual
+    float variance{0.0f};  // 0 never stops early
+    std::function<bool()> interrupted;
+};
+
+// Holds renders of each volume near a frame time budget by trading
+// quality for speed, judged on the last --latency-window frame times.
+// Levels go from the cheapest settings up to what the request asked for:
+// frames render at a fraction of the image size and are upscaled, with
+// fewer samples and a lower volume sampling rate.
+struct LatencyLevel {
+    float scale;
+    int pixelSamples;
+    float volumeSamplingRate;
+};
+
+static const LatencyLevel kLatencyLevels[] = {
+    { 0.25f, 1, 0.125f },
+    { 0.5f, 1, 0.25f },
+    { 0.5f, 1, 0.5f },
+    { 0.75f, 1, 0.5f },
+    { 1.0f, 1, 1.0f },
+    { 1.0f, std::numeric_limits<int>::max(), std::numeric_limits<float>::infinity() },
+};
+static const int kLatencyLevelCount = sizeof(kLatencyLevels) / sizeof(kLatencyLevels[0]);
+
+struct LatencyState {
+    int level{kLatencyLevelCount - 1};
+    std::deque<size_t> frameTimes;  // microseconds, all at level
+};
+
+static std::mutex gLatencyMutex;
+static std::map<std::string, LatencyState> gLatency;
+
+// Lowers quality to the volume's current level and returns the level, or
+// -1 without a budget
+static int xLatencyQuality(const std::string &volumeName, size_t budget, RendererQuality &quality, float &scale) {
+    scale = 1.0f;
+    if (budget == 0) {
+        return -1;
+    }
+
+    int level = ({
+        std::unique_lock<std::mutex> lock(gLatencyMutex);
+        gLatency[volumeName].level;
+    });
+
+    const LatencyLevel &settings = kLatencyLevels[level];
+    scale = settings.scale;
+    quality.pixelSamples = std::min(quality.pixelSamples, settings.pixelSamples);
+    quality.volumeSamplingRate = std::min(quality.volumeSamplingRate, settings.volumeSamplingRate);
+    return level;
+}
+
+// Whether a level from xLatencyQuality rendered below what was asked for
+static bool xLatencyLowered(int level) {
+    return level >= 0 && level < kLatencyLevelCount - 1;
+}
+
+// Steps down a level as soon as the frames average over budget, or one
+// takes twice as long. Steps up once a full window averages under half of
+// it, since a level costs up to about twice the one below.
+static void xLatencyRecord(const std::string &volumeName, int level, size_t budget, size_t frameTime) {
+    if (level < 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(gLatencyMutex);
+    LatencyState &state = gLatency[volumeName];
+    if (state.level != level) {
+        // Rendered before the last change
+        return;
+    }
+
+    state.frameTimes.push_back(frameTime);
+    while (state.frameTimes.size() > gOptions.latencyWindow) {
+        state.frameTimes.pop_front();
+    }
+
+    size_t total = 0;
+    for (size_t x : state.frameTimes) total += x;
+    size_t count = state.frameTimes.size();
+    size_t mean = total / count;
+
+    int next = level;
+    if (level > 0 && (frameTime > 2 * budget || (count >= 2 && mean > budget))) {
+        next = level - 1;
+    } else if (level < kLatencyLevelCount - 1 && count == gOptions.latencyWindow && mean < budget / 2) {
+        next = level + 1;
+    }
+
+    if (next != level) {
+        std::fprintf(stderr, "Latency level for %s: %d -> %d, %zu us average against %zu us\n", volumeName.c_str(), level, next, mean, budget);
+        state.level = next;
+        state.frameTimes.clear();
+    }
+}
+
+using RenderCallback = std::function<void(const RenderResult &)>;
+
+// Frames handed to the encoder thread that it has not finished yet. The
+// frame buffer of frame N is reused by frame N+pipelineDepth, so rendering
+// waits until at most pipelineDepth-1 frames are still being encoded.
+static WorkQueue gEncodeQueue;
+static struct {
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t submitted{0};
+    size_t finished{0};
+} gPipeline;
+
+// Serializes whole responses from the main and encoder threads
+static std::mutex gOutputMutex;
+
+// Without reset, the frame adds its samples to those already accumulated
+static size_t xRenderFrame(
+    OSPFrameBuffer frameBuffer,
+    OSPRenderer renderer,
+    OSPCamera camera,
+    OSPWorld world,
+    bool reset=true
+) {
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point beforeRender = Clock::now();
+    if (reset) ospResetAccumulation(frameBuffer);
+    OSPFuture future;
+    future = ospRenderFrame(frameBuffer, renderer, camera, world);
+    ospWait(future, OSP_TASK_FINISHED);
+    ospRelease(future);
+    Clock::time_point afterRender = Clock::now();
+
+    using TimeUnit = std::chrono::microseconds;
+    return std::chrono::duration_cast<TimeUnit>(afterRender - beforeRender).count();
+}
+
+// Bilinear, between pixel centers, with rows spread over the compute threads
+static void xUpscale(const uint8_t *in, int inWidth, int inHeight, uint8_t *out, int width, int height) {
+    float sx = static_cast<float>(inWidth) / width;
+    float sy = static_cast<float>(inHeight) / height;
+    xParallelFor(gComputeQueue, height, [&](size_t y) {
+        float fy = std::clamp((y + 0.5f) * sy - 0.5f, 0.0f, inHeight - 1.0f);
+        int y0 = static_cast<int>(fy), y1 = std::min(y0 + 1, inHeight - 1);
+        float ty = fy - y0;
+        for (int x=0; x<width; ++x) {
+            float fx = std::clamp((x + 0.5f) * sx - 0.5f, 0.0f, inWidth - 1.0f);
+            int x0 = static_cast<int>(fx), x1 = std::min(x0 + 1, inWidth - 1);
+            float tx = fx - x0;
+            for (int c=0; c<4; ++c) {
+                float a = in[4 * (x0 + inWidth * y0) + c] * (1 - tx) + in[4 * (x1 + inWidth * y0) + c] * tx;
+                float b = in[4 * (x0 + inWidth * y1) + c] * (1 - tx) + in[4 * (x1 + inWidth * y1) + c] * tx;
+                out[4 * (x + width * y) + c] = static_cast<uint8_t>(a * (1 - ty) + b * ty + 0.5f);
+            }
+        }
+    });
+}
+
+// Whether each region of a width x height frame of [imageStart, imageEnd]
+// misses the world's bounds, or every macrocell that shows anything. Rows
+// and columns of the frame map linearly onto that range, whichever way it
+// runs.
+static std::vector<bool> xEmptyRegions(int width, int height, const std::vector<ImageRegion> &regions) {
+    std::vector<bool> empty(regions.size(), false);
+    if (!gScene.hasBounds) {
+        return empty;
+    }
+
+    const Occupancy *occupancy = gScene.occupancy.get();
+    if (occupancy != nullptr && !occupancy->any) {
+        empty.assign(regions.size(), true);
+        return empty;
+    }
+
+    for (size_t i=0, n=regions.size(); i<n; ++i) {
+        const ImageRegion &region = regions[i];
+        float u0 = static_cast<float>(region.x) / width, u1 = static_cast<float>(region.x + region.width) / width;
+        float v0 = static_cast<float>(region.y) / height, v1 = static_cast<float>(region.y + region.height) / height;
+
+        float du = gView.imageEnd[0] - gView.imageStart[0];
+        float dv = gView.imageEnd[1] - gView.imageStart[1];
+        float imageStart[2] = { gView.imageStart[0] + u0 * du, gView.imageStart[1] + v0 * dv };
+        float imageEnd[2] = { gView.imageStart[0] + u1 * du, gView.imageStart[1] + v1 * dv };
+
+        Frustum frustum = xViewFrustum(imageStart, imageEnd);
+        empty[i] = !xBoxInFrustum(frustum, gScene.lo, gScene.hi);
+        if (!empty[i] && occupancy != nullptr) {
+            empty[i] = std::none_of(occupancy->boxes.begin(), occupancy->boxes.end(), [&](const std::array<float, 6> &box) {
+                return xBoxInFrustum(frustum, &box[0], &box[3]);
+            });
+        }
+    }
+
+    return empty;
+}
+
+// 8-bit sRGB, as the frame buffer holds colors
+using Background = std::array<uint8_t, 4>;
+
+static Background xBackground(const float color[4]) {
+    Background background;
+    for (int c=0; c<4; ++c) {
+        float x = std::clamp(color[c], 0.0f, 1.0f);
+        if (c < 3) x = x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+        background[c] = static_cast<uint8_t>(x * 255.0f + 0.5f);
+    }
+    return background;
+}
+
+// Encoded images of nothing but the background, for regions that miss the
+// world. Few distinct ones are ever asked for, so they are kept. Only used
+// by the encoding thread, like the arenas.
+static std::map<std::tuple<int, int, ImageEncoding, int, Background>, std::vector<uint8_t>> gBackgroundImages;
+
+static EncodedImage xGetBackgroundImage(int width, int height, ImageFormat format, const Background &background) {
+    auto key = std::make_tuple(width, height, format.encoding, format.quality, background);
+    auto it = gBackgroundImages.find(key);
+    if (it == gBackgroundImages.end()) {
+        std::vector<uint8_t> rgba(4UL * width * height);
+        for (size_t i=0, n=rgba.size(); i<n; i+=4) {
+            std::copy(background.begin(), background.end(), rgba.begin() + i);
+        }
+
+        size_t size = 0;
+        void *data = nullptr;
+        size_t length = xEncodeImage(rgba.data(), width, height, 4UL * width, format, &size, &data);
+        it = gBackgroundImages.emplace(key, std::vector<uint8_t>(static_cast<uint8_t *>(data), static_cast<uint8_t *>(data) + length)).first;
+        std::free(data);
+        gMemory.encodeBytes += length;
+    }
+
+    return EncodedImage{ it->second.size(), it->second.data() };
+}
+
+static RenderResult xEncodeBackground(ImageFormat format, const std::vector<ImageRegion> &regions, const Background &background) {
+    RenderResult result{ 0, 0, std::vector<EncodedImage>(regions.size()) };
+    for (size_t i=0, n=regions.size(); i<n; ++i) {
+        result.images[i] = xGetBackgroundImage(regions[i].width, regions[i].height, format, background);
+    }
+    return result;
+}
+
+// A frame buffer smaller than width x height is upscaled to it first.
+// Regions marked empty get the background image without being encoded.
+// The result, like the images in it, is reused by the next frame encoded
+// on the same thread.
+static RenderResult &xEncodeFrame(
+    OSPFrameBuffer frameBuffer,
+    int frameWidth,
+    int frameHeight,
+    int width,
+    int height,
+    ImageFormat format,
+    const std::vector<ImageRegion> &regions,
+    const std::vector<bool> &empty,
+    const Background &background,
+    size_t renderDuration
+) {
+    using Clock = std::chrono::steady_clock;
+
+    Clock::time_point beforeEncode = Clock::now();
+
+    static thread_local RenderResult result;
+    std::vector<EncodedImage> &images = result.images;
+    {
+        const void *mapped;
+        OSPFrameBufferChannel channel = OSP_FB_COLOR;
+        mapped = ospMapFrameBuffer(frameBuffer, channel);
+
+        const void *rgba = mapped;
+        if (frameWidth != width || frameHeight != height) {
+            static thread_local std::vector<uint8_t> upscaled;
+            upscaled.resize(4UL * width * height);
+            xUpscale(static_cast<const uint8_t *>(mapped), frameWidth, frameHeight, upscaled.data(), width, height);
+            rgba = upscaled.data();
+        }
+
+        size_t allocations = gEncodeStats.allocations;
+        xResize(images, regions.size());
+
+        size_t stride = 4UL * width;
+        for (size_t i=0, n=regions.size(); i<n; ++i) {
+            const ImageRegion &region = regions[i];
+            if (empty[i]) {
+                images[i] = xGetBackgroundImage(region.width, region.height, format, background);
+                continue;
+            }
+
+            const void *origin = static_cast<const uint8_t *>(rgba) + stride * region.y + 4UL * region.x;
+
+            size_t *size;
+            void **data;
+            std::tuple<size_t, void *> &arena = xGetImageArena(region.width, region.height, format.encoding, i);
+            size = &std::get<0>(arena);
+            data = &std::get<1>(arena);
+            size_t before = *size;
+            images[i].length = xEncodeImage(origin, region.width, region.height, stride, format, size, data);
+            images[i].data = *data;
+            gMemory.encodeBytes += *size - before;
+        }
+
+        gEncodeStats.frames++;
+        if (gEncodeStats.allocations != allocations) gEncodeStats.framesAllocating++;
+
+        ospUnmapFrameBuffer(mapped, frameBuffer);
+    }
+
+    Clock::time_point afterEncode = Clock::now();
+
+    using TimeUnit = std::chrono::microseconds;
+    size_t encodeDuration = std::chrono::duration_cast<TimeUnit>(afterEncode - beforeEncode).count();
+
+    result.renderDuration = renderDuration;
+    result.encodeDuration = encodeDuration;
+    result.frame = 1;
+    result.last = true;
+    result.complete = true;
+    return result;
+}
+
+// Calls callback with the encoded frame, either right away or, with
+// --pipeline, from the encoder thread while the caller moves on to the next
+// request. Callbacks run in request order either way. Each region is
+// encoded as a separate image from the one rendered frame, which lets the
+// server coalesce tiles of the same view into a single render.
+static void xCommandRender(
+    int width,
+    int height,
+    ImageFormat format,
+    std::vector<ImageRegion> regions,
+    OSPWorld world,
+    OSPRenderer renderer,
+    OSPCamera camera,
+    float scale,
+    const Progressive &progressive,
+    RenderCallback callback
+) {
+    // Frames render at scale times the image size, then get upscaled
+    int frameWidth = std::max(1, static_cast<int>(width * scale + 0.5f));
+    int frameHeight = std::max(1, static_cast<int>(height * scale + 0.5f));
+
+    if (regions.empty()) {
+        regions.push_back(ImageRegion{ 0, 0, width, height });
+    }
+
+    for (const ImageRegion &region : regions) {
+        if (region.x < 0 || region.y < 0 || region.width <= 0 || region.height <= 0
+        || region.x + region.width > width || region.y + region.height > height) {
+            std::fprintf(stderr, "ERROR: Region %dx%d+%d+%d outside of %dx%d frame\n", region.width, region.height, region.x, region.y, width, height);
+            world = nullptr;
+        }
+    }
+
+    // Frames where every region misses the world are not rendered at all
+    std::vector<bool> empty = xEmptyRegions(width, height, regions);
+    Background background = xBackground(gScene.backgroundColor);
+    bool allEmpty = world != nullptr && std::find(empty.begin(), empty.end(), false) == empty.end();
+
+    if (allEmpty && !gOptions.pipeline) {
+        callback(xEncodeBackground(format, regions, background));
+        return;
+    }
+
+    if (progressive.frames > 1 && !allEmpty && world != nullptr && renderer != nullptr && camera != nullptr) {
+        // Frames still being encoded answer earlier requests, so they go first
+        {
+            std::unique_lock<std::mutex> lock(gPipeline.mutex);
+            gPipeline.condition.wait(lock, [&]() {
+                return gPipeline.submitted == gPipeline.finished;
+            });
+        }
+
+        OSPFrameBuffer frameBuffer;
+        frameBuffer = ({
+            OSPFrameBuffer frameBuffer;
+            frameBuffer = xGetFrameBuffer(frameWidth, frameHeight, -1);
+
+            xCommit(frameBuffer);
+        });
+
+        for (int frame=1; frame<=progressive.frames; ++frame) {
+            size_t renderDuration = xRenderFrame(frameBuffer, renderer, camera, world, frame == 1);
+
+            // The estimate only updates every other frame
+            bool converged = progressive.variance > 0.0f && frame % 2 == 0 && ospGetVariance(frameBuffer) < progressive.variance;
+            bool interrupted = progressive.interrupted && progressive.interrupted();
+
+            RenderResult &result = xEncodeFrame(frameBuffer, frameWidth, frameHeight, width, height, format, regions, empty, background, renderDuration);
+            result.frame = frame;
+            result.complete = frame == progressive.frames || converged;
+            result.last = result.complete || interrupted;
+            callback(result);
+
+            if (result.last) break;
+        }
+        return;
+    }
+
+    if (!gOptions.pipeline) {
+        if (world != nullptr && renderer != nullptr && camera != nullptr) {
+            OSPFrameBuffer frameBuffer;
+            frameBuffer = ({
+                OSPFrameBuffer frameBuffer;
+                frameBuffer = xGetFrameBuffer(frameWidth, frameHeight, 0);
+
+                xCommit(frameBuffer);
+            });
+
+            size_t renderDuration = xRenderFrame(frameBuffer, renderer, camera, world);
+            callback(xEncodeFrame(frameBuffer, frameWidth, frameHeight, width, height, format, regions, empty, background, renderDuration));
+            return;
+        }
+
+        callback(RenderResult{ 0, 0, std::vector<EncodedImage>(regions.size(), EncodedImage{ 0, nullptr }) });
+        return;
+    }
+
+    size_t frame;
+    {
+        std::unique_lock<std::mutex> lock(gPipeline.mutex);
+        gPipeline.condition.wait(lock, [&]() {
+            return gPipeline.submitted - gPipeline.finished < static_cast<size_t>(gOptions.pipelineDepth);
+        });
+        frame = gPipeline.submitted++;
+    }
+
+    auto finish = [](const RenderResult &result, const RenderCallback &callback) {
+        callback(result);
+
+        {
+            std::unique_lock<std::mutex> lock(gPipeline.mutex);
+            gPipeline.finished++;
+        }
+        gPipeline.condition.notify_all();
+    };
+
+    if (allEmpty) {
+        xSubmit(gEncodeQueue, [=]() {
+            finish(xEncodeBackground(format, regions, background), callback);
+        });
+        return;
+    }
+
+    if (world == nullptr || renderer == nullptr || camera == nullptr) {
+        // Still goes through the encoder thread to keep responses in order
+        xSubmit(gEncodeQueue, [=]() {
+            finish(RenderResult{ 0, 0, std::vector<EncodedImage>(regions.size(), EncodedImage{ 0, nullptr }) }, callback);
+        });
+        return;
+    }
+
+    OSPFrameBuffer frameBuffer;
+    frameBuffer = ({
+        OSPFrameBuffer frameBuffer;
+        int slot = frame % gOptions.pipelineDepth;
+        frameBuffer = xGetFrameBuffer(frameWidth, frameHeight, slot);
+
+        xCommit(frameBuffer);
+    });
+
+    size_t renderDuration = xRenderFrame(frameBuffer, renderer, camera, world);
+
+    // The frame buffer cache may evict this one before it is encoded
+    xRetain(frameBuffer);
+    xSubmit(gEncodeQueue, [=]() {
+        finish(xEncodeFrame(frameBuffer, frameWidth, frameHeight, width, height, format, regions, empty, background, renderDuration), callback);
+        ospRelease(frameBuffer);
+    });
+}
+
+template <typename T>
+T xRead(std::istream &is=std::cin) {
+    T x;
+    is >> x;
+    return x;
+}
+
+static void xServeText() {
+    OSPWorld world = nullptr;
+    OSPRenderer renderer = nullptr;
+    OSPCamera camera = nullptr;
+    ImageFormat format{ ImageEncoding::PNG, 95 };
+    std::vector<ImageRegion> regions;
+    // Synced, std::cin reads through stdin's own buffer, where commands
+    // already read from the pipe are seen neither by in_avail nor by poll
+    std::ios::sync_with_stdio(false);
+
+    Progressive progressive;
+    progressive.interrupted = []() {
+        // First what std::cin has buffered, past the whitespace left after
+        // the last command, then what is still waiting in the pipe
+        std::streambuf *buffer = std::cin.rdbuf();
+        while (buffer->in_avail() > 0 && std::isspace(buffer->sgetc())) buffer->sbumpc();
+        if (buffer->in_avail() > 0) return true;
+        pollfd fd{ STDIN_FILENO, POLLIN, 0 };
+        return poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN);
+    };
+    size_t frameBudget = 0;  // microseconds, 0 for --frame-budget
+    // What "world" asked for. The world is built at "render", since which
+    // bricks and level of detail it uses depend on the camera and image size.
+    std::tuple<std::string, int, std::string, std::string, std::vector<float>, int> worldArguments;
+    bool hasWorld = false;
+    // Likewise "renderer", since progressive renders use one pixel sample
+    struct {
+        float backgroundColor[4];
+        RendererQuality quality;
+    } rendererArguments;
+    bool hasRenderer = false;
+
+    std::string key;
+    while (std::cin >> key)
+    if (0) {
 
-    OSPVolume volume;
-    volume = ({
-        OSPVolume volume;
-        volume = xGetVolume(volumeName, timestep);
-        if (volume == nullptr) {
-            return nullptr;
+    } else if (key == "world") {
+        auto volumeName = xRead<std::string>();
+        auto timestep = xRead<int>();
+        auto colorMapName = xRead<std::string>();
+        auto opacityMapName = xRead<std::string>();
+        std::vector<float> isosurfaceValues(xRead<size_t>());
+        for (size_t i=0, n=isosurfaceValues.size(); i<n; ++i) {
+            isosurfaceValues[i] = xRead<float>();
         }
+        auto lod = xRead<int>();  // negative picks one from the image size
+        worldArguments = std::make_tuple(volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues, lod);
+        hasWorld = true;
 
-        xCommit(volume);
-    });
-    ospSetObject(model, "volume", volume);
-    // ospRelease(volume);
+        continue;
 
-    OSPTransferFunction transferFunction;
-    transferFunction = ({
-        OSPTransferFunction transferFunction;
-        transferFunction = xNewTransferFunction(colorMapName, opacityMapName);
-        if (transferFunction == nullptr) {
-            return nullptr;
-        }
+    } else if (key == "preload") {
+        auto volumeName = xRead<std::string>();
+        auto timestep = xRead<int>();
+        xPreloadVolume(volumeName, timestep);
 
-        using Key = std::tuple<std::string, int>;
-        Key key{volumeName, timestep};
+        continue;
 
-        std::tuple<float, float> domain;
-        std::tie(std::ignore, std::ignore, domain) = volumes[key];
+    } else if (key == "status") {
+        auto volumeName = xRead<std::string>();
+        auto timestep = xRead<int>();
+        size_t status = static_cast<size_t>(xGetLoadStatus(volumeName, timestep));
 
-        float lo, hi;
-        std::tie(lo, hi) = domain;
+        std::unique_lock<std::mutex> lock(gOutputMutex);
+        std::cout.write(reinterpret_cast<const char *>(&status), sizeof(status));
+        std::cout.flush();
 
-        float value[2] = { lo, hi };
-        ospSetParam(transferFunction, "value", OSP_BOX1F, value);
+        continue;
 
-        xCommit(transferFunction);
-    });
-    ospSetObject(model, "transferFunction", transferFunction);
-    // ospRelease(transferFunction);
+    } else if (key == "catalog") {
+        std::vector<uint8_t> payload = xPackCatalog(xReloadCatalog());
 
-    return model;
-}
+        std::unique_lock<std::mutex> lock(gOutputMutex);
+        std::cout.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+        std::cout.flush();
 
-static void xErrorCallback(void *userData, OSPError error, const char *errorDetails) {
-    (void)userData;
+        continue;
+    
+    } else if (key == "camera") {
+        float position[3];
+        position[0] = xRead<float>();
+        position[1] = xRead<float>();
+        position[2] = xRead<float>();
+        float up[3];
+        up[0] = xRead<float>();
+        up[1] = xRead<float>();
+        up[2] = xRead<float>();
+        float direction[3];
+        direction[0] = xRead<float>();
+        direction[1] = xRead<float>();
+        direction[2] = xRead<float>();
+        float imageStart[2];
+        imageStart[0] = xRead<float>();  // left
+        imageStart[1] = xRead<float>();  // bottom
+        float imageEnd[2];
+        imageEnd[0] = xRead<float>();  // right
+        imageEnd[1] = xRead<float>();  // top
+        camera = xCommandCamera(position, up, direction, imageStart, imageEnd);
 
-    std::fprintf(stderr, "OSPError (%d): %s\n", (int)error, errorDetails);
-}
+        continue;
+    
+    } else if (key == "renderer") {
+        float backgroundColor[4];
+        backgroundColor[0] = xRead<int>() / 255.0f;
+        backgroundColor[1] = xRead<int>() / 255.0f;
+        backgroundColor[2] = xRead<int>() / 255.0f;
+        backgroundColor[3] = xRead<int>() / 255.0f;
+        std::copy(backgroundColor, backgroundColor + 4, rendererArguments.backgroundColor);
+        rendererArguments.quality.type = xRead<std::string>();
+        rendererArguments.quality.pixelSamples = xRead<int>();
+        rendererArguments.quality.aoSamples = xRead<int>();
+        rendererArguments.quality.volumeSamplingRate = xRead<float>();
+        rendererArguments.quality.maxPathLength = xRead<int>();
+        hasRenderer = true;
 
-static void xStatusCallback(void *userData, const char *messageText) {
-    (void)userData;
+        continue;
 
-    std::fprintf(stderr, "OSPStatus: %s\n", messageText);
-}
+    } else if (key == "encoding") {
+        auto encodingName = xRead<std::string>();
+        auto quality = xRead<int>();
+        if (!xParseImageEncoding(encodingName, format.encoding)) {
+            std::fprintf(stderr, "ERROR: Unknown image encoding: %s\n", encodingName.c_str());
+            format.encoding = ImageEncoding::PNG;
+        }
+        format.quality = std::clamp(quality, 1, 100);
 
-static OSPWorld xNewWorld(
-    const std::string &volumeName,
-    int timestep,
-    const std::string &colorMapName,
-    const std::string &opacityMapName,
-    const std::vector<float> &isosurfaceValues
-) {
-    OSPWorld world;
-    world = ospNewWorld();
+        continue;
 
-    OSPInstance instance;
-    instance = ({
-        OSPInstance instance;
-        instance = ospNewInstance(nullptr);
+    } else if (key == "tiles") {
+        regions.resize(xRead<size_t>());
+        for (ImageRegion &region : regions) {
+            region.x = xRead<int>();
+            region.y = xRead<int>();
+            region.width = xRead<int>();
+            region.height = xRead<int>();
+        }
 
-        OSPGroup group;
-        group = ({
-            OSPGroup group;
-            group = ospNewGroup();
+        continue;
 
-            if (isosurfaceValues.empty()) {
-                OSPVolumetricModel volume;
-                volume = ({
-                    OSPVolumetricModel model;
-                    model = xNewVolumetricModel(volumeName, timestep, colorMapName, opacityMapName);
-                    if (model == nullptr) {
-                        return nullptr;
-                    }
+    } else if (key == "budget") {
+        frameBudget = xRead<size_t>();
 
-                    xCommit(model);
-                });
-                ospSetObjectAsData(group, "volume", OSP_VOLUMETRIC_MODEL, volume);
-                // ospRelease(volume);
-            
-            } else {
-                OSPGeometricModel geometry;
-                geometry = ({
-                    OSPGeometricModel model;
-                    model = xNewIsosurfaceModel(volumeName, timestep, isosurfaceValues);
+        continue;
 
-                    OSPMaterial material;
-                    material = ({
-                        OSPMaterial material;
-                        const char *dummy = nullptr;
-                        const char *type = "obj";
-                        material = ospNewMaterial(dummy, type);
+    } else if (key == "progressive") {
+        progressive.frames = std::max(1, xRead<int>());
+        progressive.variance = xRead<float>();
 
-                        xCommit(material);
-                    });
-                    ospSetObject(model, "material", material);
+        continue;
 
-                    xCommit(model);
-                });
-                ospSetObjectAsData(group, "geometry", OSP_GEOMETRIC_MODEL, geometry);
-                // ospRelease(geometry);
+    } else if (key == "render") {
+        auto width = xRead<int>();
+        auto height = xRead<int>();
+
+        if (hasWorld) {
+            const auto &[volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues, lod] = worldArguments;
+            world = xCommandWorld(volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues, lod, width);
+        }
+
+        // Progressive renders have their own answer to latency
+        std::string volumeName = std::get<0>(worldArguments);
+        size_t budget = progressive.frames > 1 || !hasWorld ? 0 : frameBudget ? frameBudget : gOptions.frameBudget;
+        float scale = 1.0f;
+        int level = -1;
+        if (hasRenderer) {
+            RendererQuality quality = rendererArguments.quality;
+            if (progressive.frames > 1) quality.pixelSamples = 1;
+            level = xLatencyQuality(volumeName, budget, quality, scale);
+            renderer = xCommandRenderer(rendererArguments.backgroundColor, quality);
+        }
 
+        xCommandRender(width, height, format, regions, world, renderer, camera, scale, progressive, [=](const RenderResult &result) {
+            if (!result.images.empty() && result.images[0].length != 0) {
+                xLatencyRecord(volumeName, level, budget, result.renderDuration + result.encodeDuration);
             }
 
-            xCommit(group);
+            size_t last = result.last;
+            size_t complete = result.complete && !xLatencyLowered(level);
+            std::unique_lock<std::mutex> lock(gOutputMutex);
+            std::cout.write(reinterpret_cast<const char *>(&result.renderDuration), sizeof(result.renderDuration));
+            std::cout.write(reinterpret_cast<const char *>(&result.encodeDuration), sizeof(result.encodeDuration));
+            std::cout.write(reinterpret_cast<const char *>(&result.frame), sizeof(result.frame));
+            std::cout.write(reinterpret_cast<const char *>(&last), sizeof(last));
+            std::cout.write(reinterpret_cast<const char *>(&complete), sizeof(complete));
+            for (const EncodedImage &image : result.images) {
+                std::cout.write(reinterpret_cast<const char *>(&image.length), sizeof(image.length));
+                std::cout.write(static_cast<const char *>(image.data), image.length);
+            }
+            std::cout.flush();
         });
-        ospSetObject(instance, "group", group);
-        // ospRelease(group);
-
-        xCommit(instance);
-    });
-    ospSetObjectAsData(world, "instance", OSP_INSTANCE, instance);
-    // ospRelease(instance);
+    
+    } else {
+        std::fprintf(stderr, "Unknown key: %s\n", key.c_str());
+        continue;
 
-    return world;
+    }
 }
 
-static OSPWorld xGetWorld(
-    const std::string &volumeName,
-    int timestep,
-    const std::string &colorMapName,
-    const std::string &opacityMapName,
-    const std::vector<float> &isosurfaceValues
-) {
-    using Key = std::tuple<std::string, int, std::string, std::string, bool>;
-    static std::map<Key, OSPWorld> cache;
+// Binary protocol: every message is a MessageHeader followed by
+// payloadLength bytes of packed little-endian fields. Strings are a
+// uint16_t length followed by that many bytes.
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The binary protocol assumes a little-endian host"
+#endif
+
+static const char kMessageMagic[4] = { 'T', 'A', 'P', '3' };
+static const uint16_t kMessageVersion = 10;
+
+enum class MessageType : uint16_t {
+    Render = 1,  // renderer, world, camera, render, encoding, tiles, progressive and budget fields in that order; answered once per refined frame
+    Preload = 2,  // volumeName, timestep
+    Status = 3,  // volumeName, timestep
+    Catalog = 4,  // nothing, re-reads --catalog and answers with the volumes
+    Error = 5,  // only sent, in place of the answer to a request that could not be read: message
+};
 
-    Key key{volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues.empty()};
-    if (cache.find(key) == cache.end()) {
-        OSPWorld world;
-        world = xNewWorld(volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues);
-        if (world == nullptr) {
-            return nullptr;
-        }
+struct __attribute__((packed)) MessageHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t type;
+    uint32_t requestId;
+    uint32_t payloadLength;
+};
 
-        cache[key] = xRetain(world);
+// Reading past the end of the payload gives zeros and marks it truncated,
+// so a bad request is only checked for once all of it is read
+struct MessageReader {
+    const uint8_t *cursor;
+    const uint8_t *end;
+    bool truncated{false};
+};
+
+static bool xUnpackSpan(MessageReader &reader, size_t size) {
+    if (static_cast<size_t>(reader.end - reader.cursor) < size) {
+        reader.cursor = reader.end;
+        reader.truncated = true;
+        return false;
     }
 
-    return cache[key];
+    return true;
 }
 
+template <typename T>
+static T xUnpack(MessageReader &reader) {
+    T x{};
+    if (!xUnpackSpan(reader, sizeof(x))) return x;
+    std::memcpy(&x, reader.cursor, sizeof(x));
+    reader.cursor += sizeof(x);
+    return x;
+}
 
-static OSPFrameBuffer xNewFrameBuffer(int width, int height) {
-    OSPFrameBuffer frameBuffer;
-    OSPFrameBufferFormat format = OSP_FB_SRGBA;
-    uint32_t channels = OSP_FB_COLOR | OSP_FB_ACCUM;
-    frameBuffer = ospNewFrameBuffer(width, height, format, channels);
+template <>
+std::string xUnpack<std::string>(MessageReader &reader) {
+    auto length = xUnpack<uint16_t>(reader);
+    if (!xUnpackSpan(reader, length)) return std::string();
+    std::string x(reinterpret_cast<const char *>(reader.cursor), length);
+    reader.cursor += length;
+    return x;
+}
 
-    return frameBuffer;
+// A count of elements that follow, each at least size bytes, so a bad one
+// cannot ask for more memory than the payload could fill
+static uint32_t xUnpackCount(MessageReader &reader, size_t size) {
+    auto count = xUnpack<uint32_t>(reader);
+    if (!xUnpackSpan(reader, count * size)) return 0;
+    return count;
 }
 
-static OSPFrameBuffer xGetFrameBuffer(int width, int height) {
-    using Key = std::tuple<int, int>;
-    static std::map<Key, OSPFrameBuffer> cache;
-    Key key{width, height};
+static bool xReadMessage(MessageHeader &header, std::vector<uint8_t> &payload) {
+    std::size_t nread;
+    nread = std::fread(&header, 1, sizeof(header), stdin);
+    if (nread == 0) return false;
+    if (nread < sizeof(header)) xDie("Failed to read message header: %zu < %zu", nread, sizeof(header));
 
-    if (cache.find(key) == cache.end()) {
-        OSPFrameBuffer frameBuffer;
-        frameBuffer = xNewFrameBuffer(width, height);
+    if (std::memcmp(header.magic, kMessageMagic, sizeof(kMessageMagic)) != 0) xDie("Bad message magic");
+    if (header.version != kMessageVersion) xDie("Unsupported message version: %u", header.version);
+
+    payload.resize(header.payloadLength);
+    nread = std::fread(payload.data(), 1, payload.size(), stdin);
+    if (nread < payload.size()) xDie("Failed to read message payload: %zu < %zu", nread, payload.size());
+
+    return true;
+}
 
-        cache[key] = xRetain(frameBuffer);
+static void xWriteMessage(MessageType type, uint32_t requestId, size_t count, const void *const *datas, const size_t *sizes) {
+    MessageHeader header;
+    std::memcpy(header.magic, kMessageMagic, sizeof(kMessageMagic));
+    header.version = kMessageVersion;
+    header.type = static_cast<uint16_t>(type);
+    header.requestId = requestId;
+    header.payloadLength = 0;
+    for (size_t i=0; i<count; ++i) {
+        header.payloadLength += sizes[i];
     }
 
-    return cache[key];
+    std::unique_lock<std::mutex> lock(gOutputMutex);
+    std::fwrite(&header, 1, sizeof(header), stdout);
+    for (size_t i=0; i<count; ++i) {
+        std::fwrite(datas[i], 1, sizes[i], stdout);
+    }
+    std::fflush(stdout);
 }
 
-static OSPCamera xNewCamera(
-    const std::string &type
-) {
-    OSPCamera camera;
-    camera = ospNewCamera(type.c_str());
+// Answers a request that could not be read, so only that one fails
+static void xWriteError(uint32_t requestId, const std::string &message) {
+    std::fprintf(stderr, "ERROR: Request %u: %s\n", requestId, message.c_str());
 
-    return camera;
+    uint16_t length = static_cast<uint16_t>(std::min<size_t>(message.size(), UINT16_MAX));
+    const void *datas[2] = { &length, message.data() };
+    size_t sizes[2] = { sizeof(length), length };
+    xWriteMessage(MessageType::Error, requestId, 2, datas, sizes);
 }
 
-static OSPCamera xGetCamera(
-    const std::string &type,
-    float position[3],
-    float up[3],
-    float direction[3],
-    float imageStart[2],
-    float imageEnd[2]
-) {
-    using Key = std::tuple<std::string>;
-    static std::map<Key, OSPCamera> cache;
+// Requests that have been read from stdin but not handled yet. Reading on
+// its own thread lets the server keep writing while a frame renders.
+struct MessageQueue {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::tuple<MessageHeader, std::vector<uint8_t>>> messages;
+    bool closed{false};
+};
 
-    Key key = std::make_tuple(type);
-    if (cache.find(key) == cache.end()) {
-        OSPCamera camera;
-        camera = xNewCamera(type);
+static void xMessageQueueThread(MessageQueue *queue) {
+    for (;;) {
+        MessageHeader header;
+        std::vector<uint8_t> payload;
+        bool ok = xReadMessage(header, payload);
 
-        ospRetain(camera);
-        cache[key] = camera;
-    }
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            if (ok) {
+                queue->messages.emplace_back(header, std::move(payload));
+            } else {
+                queue->closed = true;
+            }
+        }
+        queue->condition.notify_one();
 
-    OSPCamera camera;
-    camera = cache[key];
+        if (!ok) return;
+    }
+}
 
-    ospSetParam(camera, "position", OSP_VEC3F, position);
-    ospSetParam(camera, "up", OSP_VEC3F, up);
-    ospSetParam(camera, "direction", OSP_VEC3F, direction);
-    ospSetParam(camera, "imageStart", OSP_VEC2F, imageStart);
-    ospSetParam(camera, "imageEnd", OSP_VEC2F, imageEnd);
+static bool xNextMessage(MessageQueue &queue, MessageHeader &header, std::vector<uint8_t> &payload) {
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    queue.condition.wait(lock, [&]() { return queue.closed || !queue.messages.empty(); });
+    if (queue.messages.empty()) return false;
 
-    return camera;
+    std::tie(header, payload) = std::move(queue.messages.front());
+    queue.messages.pop_front();
+    return true;
 }
 
-static OSPRenderer xNewRenderer(const std::string &type) {
-    OSPRenderer renderer;
-    renderer = ospNewRenderer(type.c_str());
+static void xServeBinary() {
+    OSPWorld world = nullptr;
+    OSPRenderer renderer = nullptr;
+    OSPCamera camera = nullptr;
 
-    int pixelSamples[] = { 2 };
-    ospSetParam(renderer, "pixelSamples", OSP_INT, pixelSamples);
+    MessageQueue queue;
+    std::thread thread(xMessageQueueThread, &queue);
 
-    // int maxPathLength[] = { 60 };
-    // ospSetParam(renderer, "maxPathLength", OSP_INT, maxPathLength);
+    MessageHeader header;
+    std::vector<uint8_t> payload;
+    while (xNextMessage(queue, header, payload)) {
+        MessageReader reader{ payload.data(), payload.data() + payload.size() };
 
-    return renderer;
-}
+        auto type = static_cast<MessageType>(header.type);
+        if (0) {
 
-static OSPRenderer xGetRenderer(
-    const std::string &type,
-    float backgroundColor[4]
-) {
-    using Key = std::tuple<std::string>;
-    static std::map<Key, OSPRenderer> cache;
+        } else if (type == MessageType::Render) {
+            float backgroundColor[4];
+            for (int i=0; i<4; ++i) {
+                backgroundColor[i] = xUnpack<uint8_t>(reader) / 255.0f;
+            }
+            RendererQuality quality;
+            quality.type = xUnpack<std::string>(reader);
+            quality.pixelSamples = xUnpack<uint16_t>(reader);
+            quality.aoSamples = xUnpack<uint16_t>(reader);
+            quality.volumeSamplingRate = xUnpack<float>(reader);
+            quality.maxPathLength = xUnpack<uint16_t>(reader);
+
+            auto volumeName = xUnpack<std::string>(reader);
+            auto timestep = xUnpack<int32_t>(reader);
+            auto colorMapName = xUnpack<std::string>(reader);
+            auto opacityMapName = xUnpack<std::string>(reader);
+            std::vector<float> isosurfaceValues(xUnpackCount(reader, sizeof(float)));
+            for (size_t i=0, n=isosurfaceValues.size(); i<n; ++i) {
+                isosurfaceValues[i] = xUnpack<float>(reader);
+            }
+            auto lod = xUnpack<int32_t>(reader);
+
+            float position[3], up[3], direction[3], imageStart[2], imageEnd[2];
+            for (int i=0; i<3; ++i) position[i] = xUnpack<float>(reader);
+            for (int i=0; i<3; ++i) up[i] = xUnpack<float>(reader);
+            for (int i=0; i<3; ++i) direction[i] = xUnpack<float>(reader);
+            for (int i=0; i<2; ++i) imageStart[i] = xUnpack<float>(reader);
+            for (int i=0; i<2; ++i) imageEnd[i] = xUnpack<float>(reader);
+
+            auto width = xUnpack<uint32_t>(reader);
+            auto height = xUnpack<uint32_t>(reader);
+
+            ImageFormat format;
+            format.encoding = static_cast<ImageEncoding>(xUnpack<uint8_t>(reader));
+            format.quality = std::clamp<int>(xUnpack<uint8_t>(reader), 1, 100);
+
+            std::vector<ImageRegion> regions(xUnpackCount(reader, 4 * sizeof(uint32_t)));
+            for (ImageRegion &region : regions) {
+                region.x = xUnpack<uint32_t>(reader);
+                region.y = xUnpack<uint32_t>(reader);
+                region.width = xUnpack<uint32_t>(reader);
+                region.height = xUnpack<uint32_t>(reader);
+            }
+
+            Progressive progressive;
+            progressive.frames = std::max<int>(1, xUnpack<uint16_t>(reader));
+            progressive.variance = xUnpack<float>(reader);
+            progressive.interrupted = [&queue]() {
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                return !queue.messages.empty();
+            };
+
+            size_t budget = xUnpack<uint32_t>(reader);
+            if (reader.truncated) {
+                xWriteError(header.requestId, "Truncated render request");
+                continue;
+            }
+
+            if (format.encoding > ImageEncoding::RGBA) {
+                std::fprintf(stderr, "ERROR: Unknown image encoding: %u\n", static_cast<unsigned>(format.encoding));
+                format.encoding = ImageEncoding::PNG;
+            }
+
+            camera = xCommandCamera(position, up, direction, imageStart, imageEnd);
+
+            // After the camera and size, which pick the bricks and level of detail
+            world = xCommandWorld(volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues, lod, width);
+
+            // Progressive renders have their own answer to latency
+            if (budget == 0) budget = gOptions.frameBudget;
+            if (progressive.frames > 1) budget = 0;
+
+            if (progressive.frames > 1) quality.pixelSamples = 1;
+            float scale;
+            int level = xLatencyQuality(volumeName, budget, quality, scale);
+            renderer = xCommandRenderer(backgroundColor, quality);
+
+            uint32_t requestId = header.requestId;
+            xCommandRender(width, height, format, regions, world, renderer, camera, scale, progressive, [=](const RenderResult &result) {
+                if (!result.images.empty() && result.images[0].length != 0) {
+                    xLatencyRecord(volumeName, level, budget, result.renderDuration + result.encodeDuration);
+                }
+
+                size_t count = result.images.size();
+                bool complete = result.complete && !xLatencyLowered(level);
+                uint64_t fields[5] = { result.renderDuration, result.encodeDuration, result.frame, result.last, complete };
+
+                // Kept from message to message, like the encoded images
+                static thread_local std::vector<uint64_t> lengths;
+                static thread_local std::vector<const void *> datas;
+                static thread_local std::vector<size_t> sizes;
+                xResize(lengths, count);
+                xResize(datas, 1 + 2 * count);
+                xResize(sizes, 1 + 2 * count);
+                datas[0] = fields;
+                sizes[0] = sizeof(fields);
+                for (size_t i=0; i<count; ++i) {
+                    lengths[i] = result.images[i].length;
+                    datas[1 + 2*i] = &lengths[i];
+                    datas[2 + 2*i] = result.images[i].data;
+                    sizes[1 + 2*i] = sizeof(lengths[i]);
+                    sizes[2 + 2*i] = result.images[i].length;
+                }
+                xWriteMessage(type, requestId, datas.size(), datas.data(), sizes.data());
+            });
+
+        } else if (type == MessageType::Preload) {
+            auto volumeName = xUnpack<std::string>(reader);
+            auto timestep = xUnpack<int32_t>(reader);
+            if (reader.truncated) {
+                xWriteError(header.requestId, "Truncated preload request");
+                continue;
+            }
+            xPreloadVolume(volumeName, timestep);
+
+        } else if (type == MessageType::Status) {
+            auto volumeName = xUnpack<std::string>(reader);
+            auto timestep = xUnpack<int32_t>(reader);
+            if (reader.truncated) {
+                xWriteError(header.requestId, "Truncated status request");
+                continue;
+            }
+            uint64_t status = static_cast<uint64_t>(xGetLoadStatus(volumeName, timestep));
+
+            const void *datas[1] = { &status };
+            size_t sizes[1] = { sizeof(status) };
+            xWriteMessage(type, header.requestId, 1, datas, sizes);
+
+        } else if (type == MessageType::Catalog) {
+            std::vector<uint8_t> payload = xPackCatalog(xReloadCatalog());
+
+            const void *datas[1] = { payload.data() };
+            size_t sizes[1] = { payload.size() };
+            xWriteMessage(type, header.requestId, 1, datas, sizes);
 
-    Key key{type};
-    if (cache.find(key) == cache.end()) {
-        OSPRenderer renderer;
-        renderer = xNewRenderer(type);
+        } else {
+            xWriteError(header.requestId, "Unknown message type: " + std::to_string(header.type));
 
-        cache[key] = xRetain(renderer);
+        }
     }
 
-    OSPRenderer renderer;
-    renderer = cache[key];
+    thread.join();
+}
 
-    ospSetParam(renderer, "backgroundColor", OSP_VEC4F, backgroundColor);
+// NAME=VALUE, where NAME is one of kCacheNames
+static std::tuple<std::string, std::string> xParseCacheLimit(const std::string &arg) {
+    size_t equals = arg.find('=');
+    if (equals == std::string::npos) xDie("Expected NAME=VALUE: %s", arg.c_str());
 
-    return renderer;
+    std::string name = arg.substr(0, equals);
+    if (std::find(std::begin(kCacheNames), std::end(kCacheNames), name) == std::end(kCacheNames)) {
+        xDie("Unknown cache: %s", name.c_str());
+    }
+
+    return std::make_tuple(name, arg.substr(equals + 1));
 }
 
-template <typename T>
-T xRead(std::istream &is=std::cin) {
-    T x;
-    is >> x;
-    return x;
+// Byte count with an optional K, M or G suffix (powers of 1024)
+static size_t xParseSize(const std::string &arg) {
+    size_t end;
+    size_t size = std::stoul(arg, &end);
+    std::string suffix = arg.substr(end);
+    if (0) {
+    } else if (suffix == "") {
+    } else if (suffix == "K") {
+        size <<= 10;
+    } else if (suffix == "M") {
+        size <<= 20;
+    } else if (suffix == "G") {
+        size <<= 30;
+    } else {
+        xDie("Unknown size suffix: %s", arg.c_str());
+    }
+
+    return size;
 }
 
 int main(int argc, const char **argv) {
@@ -730,150 +4570,121 @@ int main(int argc, const char **argv) {
 
     (void)device;
 
-    OSPFrameBuffer frameBuffer;
-    OSPWorld world;
-    OSPRenderer renderer;
-    OSPCamera camera;
-
-    std::string key;
-    while (std::cin >> key)
-    if (0) {
-
-    } else if (key == "world") {
-        world = ({
-            OSPWorld world;
-            auto volumeName = xRead<std::string>();
-            auto timestep = xRead<int>();
-            auto colorMapName = xRead<std::string>();
-            auto opacityMapName = xRead<std::string>();
-            std::vector<float> isosurfaceValues(xRead<size_t>());
-            for (size_t i=0, n=isosurfaceValues.size(); i<n; ++i) {
-                isosurfaceValues[i] = xRead<float>();
-            }
-            world = xGetWorld(volumeName, timestep, colorMapName, opacityMapName, isosurfaceValues);
-            if (world == nullptr) {
-                std::fprintf(stderr, "world is null\n");
-                continue;
-            }
-
-            xCommit(world);
-        });
-
-        continue;
-    
-    } else if (key == "camera") {
-        camera = ({
-            OSPCamera camera;
-            const char *type = "perspective";
-            float position[3];
-            position[0] = xRead<float>();
-            position[1] = xRead<float>();
-            position[2] = xRead<float>();
-            float up[3];
-            up[0] = xRead<float>();
-            up[1] = xRead<float>();
-            up[2] = xRead<float>();
-            float direction[3];
-            direction[0] = xRead<float>();
-            direction[1] = xRead<float>();
-            direction[2] = xRead<float>();
-            float imageStart[2];
-            imageStart[0] = xRead<float>();  // left
-            imageStart[1] = xRead<float>();  // bottom
-            float imageEnd[2];
-            imageEnd[0] = xRead<float>();  // right
-            imageEnd[1] = xRead<float>();  // top
-            camera = xGetCamera(type, position, up, direction, imageStart, imageEnd);
-
-            xCommit(camera);
-        });
-
-        continue;
-    
-    } else if (key == "renderer") {
-        renderer = ({
-            OSPRenderer renderer;
-            const char *type = "ao";
-            float backgroundColor[4];
-            backgroundColor[0] = xRead<int>() / 255.0f;
-            backgroundColor[1] = xRead<int>() / 255.0f;
-            backgroundColor[2] = xRead<int>() / 255.0f;
-            backgroundColor[3] = xRead<int>() / 255.0f;
-            renderer = xGetRenderer(type, backgroundColor);
-
-            xCommit(renderer);
-        });
-        continue;
-
-    } else if (key == "render") {
-        auto width = xRead<int>();
-        auto height = xRead<int>();
-        frameBuffer = ({
-            OSPFrameBuffer frameBuffer;
-            frameBuffer = xGetFrameBuffer(width, height);
-
-            xCommit(frameBuffer);
-        });
-
-        using Clock = std::chrono::steady_clock;
-
-        Clock::time_point beforeRender = Clock::now();
-        ospResetAccumulation(frameBuffer);
-        ospRenderFrameBlocking(frameBuffer, renderer, camera, world);
-        Clock::time_point afterRender = Clock::now();
-
-        Clock::time_point beforeEncode = Clock::now();
-
-        size_t imageLength;
-        void *imageData;
-        std::tie(imageLength, imageData) = ({
-            const void *rgbaOriginal;
-            OSPFrameBufferChannel channel = OSP_FB_COLOR;
-            rgbaOriginal = ospMapFrameBuffer(frameBuffer, channel);
-
-            std::vector<uint8_t> rgba(static_cast<const uint8_t *>(rgbaOriginal), static_cast<const uint8_t *>(rgbaOriginal) + 4 * width * height);
-            // for (int i=0, n=width*height; i<n; ++i) {
-            //     float ratio = rgba[4*i+3] / 255.0f;
-            //     for (int j=0; j<4; ++j) {
-            //         float f = rgba[4*i+j] * ratio + 0.0 * (1.0f - ratio);
-            //         uint8_t u = f >= 255.0f ? 255 : f <= 0.0 ? 0 : static_cast<uint8_t>(f);
-            //         rgba[4*i+j] = u;
-            //     }
-            // }
-
-            size_t length;
-            static size_t size = 4UL * 1024UL * 1024UL;
-            static void *data = std::malloc(size);
-            length = xToPNG(rgba.data(), width, height, &size, &data);
-
-            // const char *filename = "out.jpg";
-            // xWriteBytes(filename, length, data);
-            // std::fprintf(stdout, "Wrote %zu bytes to %s\n", length, filename);
-
-            // stbi_write_png("out.png", 256, 256, 4, rgba, 0);
+    for (int i=1; i<argc; ++i) {
+        std::string arg = argv[i];
+        if (0) {
+        } else if (arg == "--load" && i+1 < argc) {
+            gOptions.loadMode = argv[++i];
+        } else if (arg == "--mmap-populate") {
+            gOptions.mmapPopulate = true;
+        } else if (arg == "--mmap-advice" && i+1 < argc) {
+            gOptions.mmapAdvice = argv[++i];
+        } else if (arg == "--io-threads" && i+1 < argc) {
+            gOptions.ioThreads = std::stoi(argv[++i]);
+            // Preloads would never run, leaving every volume Loading
+            if (gOptions.ioThreads < 1) xDie("Expected at least 1 I/O thread: %d", gOptions.ioThreads);
+        } else if (arg == "--read-engine" && i+1 < argc) {
+            gOptions.readEngine = argv[++i];
+            if (gOptions.readEngine != "uring" && gOptions.readEngine != "threads") xDie("Unknown read engine: %s", gOptions.readEngine.c_str());
+        } else if (arg == "--read-depth" && i+1 < argc) {
+            gOptions.readDepth = std::stoi(argv[++i]);
+            if (gOptions.readDepth < 1 || gOptions.readDepth > 4096) xDie("Expected a read depth from 1 to 4096: %d", gOptions.readDepth);
+        } else if (arg == "--read-chunk" && i+1 < argc) {
+            gOptions.readChunk = xParseSize(argv[++i]);
+            if (gOptions.readChunk == 0 || gOptions.readChunk % 4096 != 0 || gOptions.readChunk > (1UL << 30)) xDie("Expected a read chunk that is a multiple of 4K, up to 1G: %zu", gOptions.readChunk);
+        } else if (arg == "--protocol" && i+1 < argc) {
+            gOptions.protocol = argv[++i];
+        } else if (arg == "--pipeline") {
+            gOptions.pipeline = true;
+        } else if (arg == "--pipeline-depth" && i+1 < argc) {
+            gOptions.pipelineDepth = std::stoi(argv[++i]);
+        } else if (arg == "--threads" && i+1 < argc) {
+            gOptions.threads = std::stoi(argv[++i]);
+        } else if (arg == "--png-encoder" && i+1 < argc) {
+            gOptions.pngEncoder = argv[++i];
+        } else if (arg == "--png-level" && i+1 < argc) {
+            gOptions.pngLevel = std::stoi(argv[++i]);
+        } else if (arg == "--cache-entries" && i+1 < argc) {
+            std::string name, value;
+            std::tie(name, value) = xParseCacheLimit(argv[++i]);
+            gOptions.cacheEntries[name] = std::stoul(value);
+        } else if (arg == "--cache-bytes" && i+1 < argc) {
+            std::string name, value;
+            std::tie(name, value) = xParseCacheLimit(argv[++i]);
+            gOptions.cacheBytes[name] = xParseSize(value);
+        } else if (arg == "--memory-limit" && i+1 < argc) {
+            gOptions.memoryLimit = xParseSize(argv[++i]);
+        } else if (arg == "--histogram-bins" && i+1 < argc) {
+            gOptions.histogramBins = std::stoul(argv[++i]);
+            if (gOptions.histogramBins == 0) xDie("Expected at least one histogram bin");
+        } else if (arg == "--frame-budget" && i+1 < argc) {
+            gOptions.frameBudget = static_cast<size_t>(std::stod(argv[++i]) * 1000.0);
+        } else if (arg == "--latency-window" && i+1 < argc) {
+            gOptions.latencyWindow = std::stoul(argv[++i]);
+            if (gOptions.latencyWindow < 2) xDie("Expected a latency window of at least 2 frames");
+        } else if (arg == "--lod-levels" && i+1 < argc) {
+            gOptions.lodLevels = std::stoi(argv[++i]);
+            if (gOptions.lodLevels < 0) xDie("Expected at least 0 levels of detail: %d", gOptions.lodLevels);
+        } else if (arg == "--macrocell-size" && i+1 < argc) {
+            gOptions.macrocellSize = std::stoi(argv[++i]);
+            if (gOptions.macrocellSize < 0) xDie("Expected a macrocell size of at least 0: %d", gOptions.macrocellSize);
+        } else if (arg == "--catalog" && i+1 < argc) {
+            gOptions.catalog = argv[++i];
+        } else if (arg == "--stats-directory" && i+1 < argc) {
+            gOptions.statsDirectory = argv[++i];
+        } else if (arg == "--precision" && i+1 < argc) {
+            gOptions.precision = argv[++i];
+        } else if (arg == "--volume-precision" && i+1 < argc) {
+            std::string volumePrecision = argv[++i];
+            size_t equals = volumePrecision.find('=');
+            if (equals == std::string::npos) xDie("Expected NAME=PRECISION: %s", volumePrecision.c_str());
+            gOptions.volumePrecision[volumePrecision.substr(0, equals)] = volumePrecision.substr(equals + 1);
+        } else {
+            xDie("Unknown argument: %s", arg.c_str());
+        }
+    }
 
-            ospUnmapFrameBuffer(rgbaOriginal, frameBuffer);
+    if (gOptions.pipelineDepth < 2) {
+        xDie("Pipeline depth must be at least 2: %d", gOptions.pipelineDepth);
+    }
 
-            std::make_tuple(length, data);
-        });
+    if (gOptions.pngLevel < 0 || gOptions.pngLevel > 9) {
+        xDie("PNG level must be in 0..9: %d", gOptions.pngLevel);
+    }
+    stbi_write_png_compression_level = gOptions.pngLevel;
 
-        Clock::time_point afterEncode = Clock::now();
+    if (!gOptions.catalog.empty()) {
+        std::map<std::tuple<std::string, int>, VolumeInfo> catalog;
+        if (!xReadCatalog(gOptions.catalog, catalog)) xDie("Failed to read catalog: %s", gOptions.catalog.c_str());
+        volumes = std::move(catalog);
+    }
 
-        using TimeUnit = std::chrono::microseconds;
-        size_t renderDuration = std::chrono::duration_cast<TimeUnit>(afterRender - beforeRender).count();
-        size_t encodeDuration = std::chrono::duration_cast<TimeUnit>(afterEncode - beforeEncode).count();
+    xStartWorkQueue(gLoadQueue, gOptions.ioThreads);
+    xStartWorkQueue(gComputeQueue, gOptions.threads);
+    // A single encoder thread keeps responses in request order
+    if (gOptions.pipeline) xStartWorkQueue(gEncodeQueue, 1);
 
-        std::cout.write(reinterpret_cast<const char *>(&renderDuration), sizeof(renderDuration));
-        std::cout.write(reinterpret_cast<const char *>(&encodeDuration), sizeof(encodeDuration));
-        std::cout.write(reinterpret_cast<const char *>(&imageLength), sizeof(imageLength));
-        std::cout.write(static_cast<const char *>(imageData), imageLength);
-        std::cout.flush();
-    
+    if (0) {
+    } else if (gOptions.protocol == "text") {
+        xServeText();
+    } else if (gOptions.protocol == "binary") {
+        xServeBinary();
     } else {
-        std::fprintf(stderr, "Unknown key: %s\n", key.c_str());
-        continue;
+        xDie("Unknown protocol: %s", gOptions.protocol.c_str());
+    }
 
+    // Drain the encoder first: its queued frames still owe responses
+    {
+        std::unique_lock<std::mutex> lock(gPipeline.mutex);
+        gPipeline.condition.wait(lock, [&]() { return gPipeline.finished == gPipeline.submitted; });
     }
+    xStopWorkQueue(gEncodeQueue);
+    // Loads in progress hand chunks to the compute threads, so those go last
+    xStopWorkQueue(gLoadQueue);
+    xStopWorkQueue(gComputeQueue);
+
+    std::fprintf(stderr, "Encoded %zu frames, %zu of which allocated (%zu allocations)\n",
+        gEncodeStats.frames, gEncodeStats.framesAllocating, static_cast<size_t>(gEncodeStats.allocations));
 
     return 0;
 }
@@ -19,13 +19,23 @@ import math
 import threading
 import pkgutil
 import time
+import shlex
+import enum
+import json
+import hashlib
+import bisect
+import concurrent.futures
+import collections
+import queue
+import io
 
-from flask import Flask
+from flask import Flask, Response
 
 
 app = Flask(__name__)
-_g_renderer: Renderer
-_g_renderer_lock: threading.Lock = threading.Lock()
+_g_engines: EnginePool
+_g_coalescer: TileCoalescer
+_g_cache: ImageCache
 _g_extra_fileobj: FileLike = None
 
 
@@ -41,15 +51,81 @@ quant = decimal.Context(
 ).create_decimal
 
 
+class MessageType(enum.IntEnum):
+    Render = 1
+    Preload = 2
+    Status = 3
+    Catalog = 4
+    Error = 5
+
+
+class ImageEncoding(enum.IntEnum):
+    PNG = 0
+    JPEG = 1
+    QOI = 2
+    RGBA = 3
+
+    @property
+    def contentType(self) -> str:
+        return {
+            ImageEncoding.PNG: 'image/png',
+            ImageEncoding.JPEG: 'image/jpeg',
+            ImageEncoding.QOI: 'image/qoi',
+            ImageEncoding.RGBA: 'application/octet-stream',
+        }[self]
+
+
+# Binary protocol framing, see MessageHeader in src/engine/main.cpp
+MESSAGE_MAGIC = b'TAP3'
+MESSAGE_VERSION = 10
+MESSAGE_HEADER = '<4sHHII'
+
+
+def pack_message(type: MessageType, requestId: int, format: str, *args: Any) -> bytes:
+    assert format.startswith('<')
+    return struct.pack(
+        MESSAGE_HEADER + format[1:],
+        MESSAGE_MAGIC, MESSAGE_VERSION, type, requestId, struct.calcsize(format),
+        *args,
+    )
+
+
+def read_message(fileobj: BinaryIO) -> Tuple[MessageType, int, bytes]:
+    size = struct.calcsize(MESSAGE_HEADER)
+    data = fileobj.read(size)
+    assert len(data) == size
+    magic, version, type, requestId, payloadLength = struct.unpack(MESSAGE_HEADER, data)
+    assert magic == MESSAGE_MAGIC, f'{magic = !r}'
+    assert version == MESSAGE_VERSION, f'{version = !r}'
+
+    payload = fileobj.read(payloadLength)
+    assert len(payload) == payloadLength
+    return MessageType(type), requestId, payload
+
+
+# Named renderer settings for the quality option of /image/, from cheapest
+# to best. Explicit renderer, samples, aosamples, samplingrate and
+# pathlength options override the tier's.
+QUALITY_TIERS: Dict[str, Dict[str, Any]] = {
+    'interactive': dict(rendererType='ao', rendererPixelSamples=1, rendererAoSamples=0, rendererVolumeSamplingRate=0.25),
+    'preview': dict(rendererType='scivis', rendererPixelSamples=1, rendererAoSamples=1, rendererVolumeSamplingRate=0.5),
+    'default': dict(),
+    'high': dict(rendererType='ao', rendererPixelSamples=8, rendererAoSamples=4, rendererVolumeSamplingRate=2.0),
+}
+
+
 @dataclass(eq=True, frozen=True)
 class RenderingRequest:
+    messageType: typing.ClassVar[MessageType] = MessageType.Render
+    hasResponse: typing.ClassVar[bool] = True
+
     imageWidth: int
     imageHeight: int
     volumeName: str
     volumeTimestep: int
     colorMapName: str
     opacityMapName: str
-    isosurfaceValues: List[float]
+    isosurfaceValues: Tuple[float, ...]
     cameraPosition: Tuple[float, float, float]
     cameraUp: Tuple[float, float, float]
     cameraDirection: Tuple[float, float, float]
@@ -58,6 +134,25 @@ class RenderingRequest:
     cameraColIndex: int
     cameraColCount: int
     backgroundColor: Tuple[float, float, float, float]
+    imageEncoding: ImageEncoding = ImageEncoding.PNG
+    imageQuality: int = 95
+    cameraRowSpan: int = 1
+    cameraColSpan: int = 1
+    # (x, y, width, height) regions to return as separate images, empty for the whole image
+    imageTiles: Tuple[Tuple[int, int, int, int], ...] = ()
+    # Level of detail, each one halving the resolution, or -1 to pick one from imageWidth
+    volumeLod: int = 0
+    # Frames accumulated one after another, each answered with a refined image,
+    # stopping early once the variance estimate is below progressiveVariance
+    progressiveFrames: int = 1
+    progressiveVariance: float = 0.0
+    rendererType: str = 'ao'
+    rendererPixelSamples: int = 2
+    rendererAoSamples: int = 1
+    rendererVolumeSamplingRate: float = 1.0
+    rendererMaxPathLength: int = 20
+    # Microseconds per frame the engine lowers quality to stay under, 0 for its own default
+    frameBudget: int = 0
 
     @property
     def cameraImageStart(self) -> Tuple[float, float]:
@@ -69,10 +164,14 @@ class RenderingRequest:
     @property
     def cameraImageEnd(self) -> Tuple[float, float]:
         return (
-            (self.cameraColIndex + 1.0) / self.cameraColCount,  # right
-            1.0 - (self.cameraRowIndex + 1.0) / self.cameraRowCount,  # top
+            (self.cameraColIndex + self.cameraColSpan) / self.cameraColCount,  # right
+            1.0 - (self.cameraRowIndex + self.cameraRowSpan) / self.cameraRowCount,  # top
         )
 
+    @property
+    def imageCount(self) -> int:
+        return max(1, len(self.imageTiles))
+
     def write(self, fileobj: BinaryIO):
         def write(s: str):
             s = s + '\n'
@@ -87,6 +186,11 @@ class RenderingRequest:
             f'{x}'
             for x in self.backgroundColor
         ]))
+        write(f'{self.rendererType}')
+        write(f'{self.rendererPixelSamples}')
+        write(f'{self.rendererAoSamples}')
+        write(f'{self.rendererVolumeSamplingRate}')
+        write(f'{self.rendererMaxPathLength}')
 
         write('world')
         write(f'{self.volumeName}')
@@ -96,6 +200,7 @@ class RenderingRequest:
         write(f'{len(self.isosurfaceValues)}')
         for x in self.isosurfaceValues:
             write(f'{x}')
+        write(f'{self.volumeLod}')
 
         write('camera')
         write(' '.join([
@@ -119,22 +224,237 @@ class RenderingRequest:
             for x in self.cameraImageEnd
         ]))
 
+        write('encoding')
+        write(f'{self.imageEncoding.name.lower()}')
+        write(f'{self.imageQuality}')
+
+        write('tiles')
+        write(f'{len(self.imageTiles)}')
+        for tile in self.imageTiles:
+            write(' '.join([
+                f'{x}'
+                for x in tile
+            ]))
+
+        write('progressive')
+        write(f'{self.progressiveFrames}')
+        write(f'{self.progressiveVariance}')
+
+        write('budget')
+        write(f'{self.frameBudget}')
+
         write('render')
         write(f'{self.imageWidth}')
         write(f'{self.imageHeight}')
 
         fileobj.flush()
 
+    def read(self, fileobj: BinaryIO) -> RenderingResponse:
+        return RenderingResponse.read(fileobj, self.imageCount)
+
+    def pack(self, requestId: int) -> bytes:
+        rendererType = self.rendererType.encode('utf-8')
+        volumeName = self.volumeName.encode('utf-8')
+        colorMapName = self.colorMapName.encode('utf-8')
+        opacityMapName = self.opacityMapName.encode('utf-8')
+        isosurfaceCount = len(self.isosurfaceValues)
+        tileCount = len(self.imageTiles)
+
+        return pack_message(
+            MessageType.Render, requestId,
+            (
+                f'<4B'
+                f'H{len(rendererType)}sHHfH'
+                f'H{len(volumeName)}si'
+                f'H{len(colorMapName)}s'
+                f'H{len(opacityMapName)}s'
+                f'I{isosurfaceCount}f'
+                f'i'
+                f'3f3f3f2f2f'
+                f'II'
+                f'BB'
+                f'I{4 * tileCount}I'
+                f'Hf'
+                f'I'
+            ),
+            *self.backgroundColor,
+            len(rendererType), rendererType,
+            self.rendererPixelSamples, self.rendererAoSamples,
+            self.rendererVolumeSamplingRate, self.rendererMaxPathLength,
+            len(volumeName), volumeName, self.volumeTimestep,
+            len(colorMapName), colorMapName,
+            len(opacityMapName), opacityMapName,
+            isosurfaceCount, *self.isosurfaceValues,
+            self.volumeLod,
+            *self.cameraPosition,
+            *self.cameraUp,
+            *self.cameraDirection,
+            *self.cameraImageStart,
+            *self.cameraImageEnd,
+            self.imageWidth, self.imageHeight,
+            self.imageEncoding, self.imageQuality,
+            tileCount, *(x for tile in self.imageTiles for x in tile),
+            self.progressiveFrames, self.progressiveVariance,
+            self.frameBudget,
+        )
+
+    def unpack(self, payload: bytes) -> RenderingResponse:
+        return RenderingResponse.unpack(payload, self.imageCount)
+
+
+@dataclass(eq=True, frozen=True)
+class PreloadRequest:
+    messageType: typing.ClassVar[MessageType] = MessageType.Preload
+    hasResponse: typing.ClassVar[bool] = False
+
+    volumeName: str
+    volumeTimestep: int
+
+    def write(self, fileobj: BinaryIO):
+        s = f'preload\n{self.volumeName}\n{self.volumeTimestep}\n'
+        s = s.encode('utf-8')
+        fileobj.write(s)
+        fileobj.flush()
+
+        if _g_extra_fileobj is not None:
+            _g_extra_fileobj.write(s)
+
+    def read(self, fileobj: BinaryIO) -> None:
+        return None
+
+    def pack(self, requestId: int) -> bytes:
+        volumeName = self.volumeName.encode('utf-8')
+
+        return pack_message(
+            MessageType.Preload, requestId,
+            f'<H{len(volumeName)}si',
+            len(volumeName), volumeName, self.volumeTimestep,
+        )
+
+
+class LoadStatus(enum.IntEnum):
+    Unknown = 0
+    Unloaded = 1
+    Loading = 2
+    Ready = 3
+    Failed = 4
+
+
+@dataclass(eq=True, frozen=True)
+class StatusRequest:
+    messageType: typing.ClassVar[MessageType] = MessageType.Status
+    hasResponse: typing.ClassVar[bool] = True
+
+    volumeName: str
+    volumeTimestep: int
+
+    def write(self, fileobj: BinaryIO):
+        s = f'status\n{self.volumeName}\n{self.volumeTimestep}\n'
+        s = s.encode('utf-8')
+        fileobj.write(s)
+        fileobj.flush()
+
+        if _g_extra_fileobj is not None:
+            _g_extra_fileobj.write(s)
+
+    def read(self, fileobj: BinaryIO) -> LoadStatus:
+        format = 'N'
+        size = struct.calcsize(format)
+        data = fileobj.read(size)
+        assert len(data) == size
+        status ,= struct.unpack(format, data)
+        return LoadStatus(status)
+
+    def pack(self, requestId: int) -> bytes:
+        volumeName = self.volumeName.encode('utf-8')
+
+        return pack_message(
+            MessageType.Status, requestId,
+            f'<H{len(volumeName)}si',
+            len(volumeName), volumeName, self.volumeTimestep,
+        )
+
+    def unpack(self, payload: bytes) -> LoadStatus:
+        status ,= struct.unpack('<Q', payload)
+        return LoadStatus(status)
+
+
+@dataclass(eq=True, frozen=True)
+class CatalogRequest:
+    """Makes the engine read its --catalog again and list its volumes."""
+
+    messageType: typing.ClassVar[MessageType] = MessageType.Catalog
+    hasResponse: typing.ClassVar[bool] = True
+
+    def write(self, fileobj: BinaryIO):
+        s = 'catalog\n'
+        s = s.encode('utf-8')
+        fileobj.write(s)
+        fileobj.flush()
+
+        if _g_extra_fileobj is not None:
+            _g_extra_fileobj.write(s)
+
+    def read(self, fileobj: BinaryIO) -> CatalogResponse:
+        return CatalogResponse.read(fileobj)
+
+    def pack(self, requestId: int) -> bytes:
+        return pack_message(MessageType.Catalog, requestId, '<')
+
+    def unpack(self, payload: bytes) -> CatalogResponse:
+        return CatalogResponse.read(io.BytesIO(payload))
+
+
+@dataclass(eq=True, frozen=True)
+class CatalogResponse:
+    volumes: Tuple[Tuple[str, int], ...]
+    # Added or changed by this read of the catalog
+    changed: FrozenSet[Tuple[str, int]]
+
+    @classmethod
+    def read(cls, fileobj: BinaryIO) -> Self:
+        def read(format: str) -> Tuple[Any, ...]:
+            size = struct.calcsize(format)
+            data = fileobj.read(size)
+            assert len(data) == size
+            return struct.unpack(format, data)
+
+        volumes = []
+        changed = set()
+        count ,= read('<I')
+        for _ in range(count):
+            nameLength ,= read('<H')
+            name ,= read(f'<{nameLength}s')
+            timestep, isChanged = read('<iB')
+            volumes.append((name.decode('utf-8'), timestep))
+            if isChanged:
+                changed.add(volumes[-1])
+
+        return cls(
+            volumes=tuple(volumes),
+            changed=frozenset(changed),
+        )
+
 
 @dataclass(eq=True, frozen=True)
 class RenderingResponse:
     renderDuration: int
     encodeDuration: int
-    imageLength: int
-    imageData: bytes
+    images: Tuple[bytes, ...]  # one per tile of the request, empty if nothing was rendered
+    frame: int = 1  # frames accumulated into the images
+    last: bool = True  # whether this is the final response to the request
+    complete: bool = True  # whether the images are at full quality, not cut short
+
+    @property
+    def imageLength(self) -> int:
+        return len(self.images[0])
+
+    @property
+    def imageData(self) -> bytes:
+        return self.images[0]
 
     @classmethod
-    def read(cls, fileobj: BinaryIO) -> Self:
+    def read(cls, fileobj: BinaryIO, count: int=1) -> Self:
         def read(format: str) -> Tuple[Any, ...]:
             size = struct.calcsize(format)
             # print(f'{format = !r} {size = !r}')
@@ -144,42 +464,549 @@ class RenderingResponse:
         
         renderDuration ,= read('N')
         encodeDuration ,= read('N')
-        imageLength ,= read('N')
-        imageData ,= read(f'{imageLength}s')
+        frame ,= read('N')
+        last ,= read('N')
+        complete ,= read('N')
+        images = []
+        for _ in range(count):
+            imageLength ,= read('N')
+            imageData ,= read(f'{imageLength}s')
+            images.append(imageData)
 
         return cls(
             renderDuration=renderDuration,
             encodeDuration=encodeDuration,
-            imageLength=imageLength,
-            imageData=imageData,
+            images=tuple(images),
+            frame=frame,
+            last=bool(last),
+            complete=bool(complete),
         )
 
+    @classmethod
+    def unpack(cls, payload: bytes, count: int=1) -> Self:
+        format = '<QQQQQ'
+        offset = struct.calcsize(format)
+        renderDuration, encodeDuration, frame, last, complete = struct.unpack_from(format, payload)
+        images = []
+        for _ in range(count):
+            imageLength ,= struct.unpack_from('<Q', payload, offset)
+            offset += struct.calcsize('<Q')
+            images.append(payload[offset:offset + imageLength])
+            offset += imageLength
+            assert len(images[-1]) == imageLength
+        assert offset == len(payload)
 
-Renderer = typing.NewType('Renderer', typing.Generator[RenderingResponse, RenderingRequest, None])
+        return cls(
+            renderDuration=renderDuration,
+            encodeDuration=encodeDuration,
+            images=tuple(images),
+            frame=frame,
+            last=bool(last),
+            complete=bool(complete),
+        )
 
 
-def make_renderer(executable: Path) -> Renderer:
-    process = subprocess.Popen([
-        executable,
-    ], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+class EngineError(Exception):
+    pass
 
-    threading.Thread(
-        target=lambda: \
-            print(f'Process ended: {process.wait() = !r}'),
-        daemon=True,
-    ).start()
 
-    response = None
-    while True:
-        request = yield response
+class RequestError(Exception):
+    """One request the engine could not read; the engine itself is fine."""
 
-        request.write(process.stdin)
 
-        response = RenderingResponse.read(process.stdout)
+class Engine:
+    """One engine process, usable from many threads at once.
 
+    With the binary protocol, requests are written as soon as they are
+    submitted and a reader thread matches each response to its request by
+    id, so several requests can be in flight. The text protocol has no
+    ids and falls back to one round trip at a time.
+
+    A progressive render is answered several times. Every response but
+    the last goes to the `partial` callback given to submit, and the
+    future resolves to the last one.
+    """
+
+    def __init__(self, executable: Path, arguments: List[str], protocol: str):
+        self.protocol = protocol
+        self.process = subprocess.Popen([
+            executable,
+            '--protocol', protocol,
+            *arguments,
+        ], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+        process = self.process
+        threading.Thread(
+            target=lambda: \
+                print(f'Process ended: {process.wait() = !r}'),
+            daemon=True,
+        ).start()
+
+        self.writeLock: threading.Lock = threading.Lock()
+        self.requestId: int = 0
+        self.pendingLock: threading.Lock = threading.Lock()
+        self.pending: Dict[int, Tuple[Any, concurrent.futures.Future, Optional[Callable[[Any], None]]]] = {}
+        self.error: Optional[EngineError] = None
+
+        if protocol == 'binary':
+            threading.Thread(
+                target=self.receive,
+                daemon=True,
+            ).start()
+
+        elif protocol != 'text':
+            raise ValueError(f'Unknown protocol: {protocol!r}')
+
+    def submit(self, request: Any, partial: Optional[Callable[[Any], None]]=None) -> concurrent.futures.Future:
+        future = concurrent.futures.Future()
+
+        with self.writeLock:
+            if self.error is not None:
+                future.set_exception(self.error)
+                return future
+
+            try:
+                if self.protocol == 'text':
+                    request.write(self.process.stdin)
+                    response = request.read(self.process.stdout)
+                    while not getattr(response, 'last', True):
+                        if partial is not None:
+                            partial(response)
+                        response = request.read(self.process.stdout)
+                    future.set_result(response)
+                    return future
+
+                self.requestId = (self.requestId + 1) % 2**32
+                if request.hasResponse:
+                    with self.pendingLock:
+                        self.pending[self.requestId] = (request, future, partial)
+                else:
+                    future.set_result(None)
+
+                message = request.pack(self.requestId)
+                self.process.stdin.write(message)
+                self.process.stdin.flush()
+
+                if _g_extra_fileobj is not None:
+                    _g_extra_fileobj.write(message)
+
+            except (OSError, AssertionError, ValueError) as e:
+                self.fail(e)
+                if not future.done():
+                    future.set_exception(self.error)
+
+        return future
+
+    def receive(self):
+        try:
+            while True:
+                type, requestId, payload = read_message(self.process.stdout)
+                if type == MessageType.Error:
+                    # The engine could not read that request, and goes on
+                    # with the others
+                    length ,= struct.unpack_from('<H', payload)
+                    message = payload[2:2+length].decode('utf-8', 'replace')
+                    with self.pendingLock:
+                        request, future, partial = self.pending.pop(requestId, (None, None, None))
+                    if future is not None:
+                        future.set_exception(RequestError(f'Engine rejected request: {message}'))
+                    continue
+
+                with self.pendingLock:
+                    request, future, partial = self.pending[requestId]
+
+                assert type == request.messageType, f'{type = !r} {request = !r}'
+                response = request.unpack(payload)
+                if not getattr(response, 'last', True):
+                    if partial is not None:
+                        partial(response)
+                    continue
+
+                with self.pendingLock:
+                    del self.pending[requestId]
+                future.set_result(response)
+
+        except Exception as e:
+            # Anything else, say from partial, would end this thread
+            # quietly and leave every pending request waiting forever
+            self.fail(e)
+
+    def fail(self, e: Exception):
+        error = EngineError(f'Engine failed: {e!r}')
+        with self.pendingLock:
+            if self.error is None:
+                self.error = error
+            pending, self.pending = self.pending, {}
+
+        for _, future, _ in pending.values():
+            future.set_exception(self.error)
+
+        self.process.kill()
+
+    def close(self):
+        self.fail(EngineError('Closed'))
+
+
+class EnginePool:
+    """N engine processes with datasets sharded across them.
+
+    Each (volumeName, timestep) is owned by `replication` engines picked
+    from a consistent hash ring, so adding an engine only moves a small
+    share of the datasets. Requests go to the least busy owner and wait on
+    on it when all owners are busy. An engine that dies mid-request is
+    replaced and the request is retried once on the replacement.
+
+    Engines are started with the same arguments, so they share a catalog
+    of volumes, which is also what gets preloaded. An engine that does not
+    answer within `timeout` seconds is treated as dead.
+    """
+
+    VIRTUAL_NODES = 64
+
+    def __init__(
+        self,
+        executable: Path,
+        arguments: List[str],
+        protocol: str,
+        count: int,
+        replication: int=1,
+        replicationOverrides: Dict[str, int]={},
+        timeout: float=60.0,
+    ):
+        self.executable = executable
+        self.arguments = arguments
+        self.protocol = protocol
+        self.replication = replication
+        self.replicationOverrides = replicationOverrides
+        self.timeout = timeout
+
+        self.ring: List[Tuple[int, int]] = sorted(
+            (self.hash(f'engine-{index}-{vnode}'), index)
+            for index in range(count)
+            for vnode in range(self.VIRTUAL_NODES)
+        )
+
+        self.pending: List[int] = [0] * count
+        self.pendingLock: threading.Lock = threading.Lock()
+        self.restartLock: threading.Lock = threading.Lock()
+        self.volumes: Tuple[Tuple[str, int], ...] = ()
+        self.engines: List[Engine] = [self.start(index) for index in range(count)]
+
+    @staticmethod
+    def hash(key: str) -> int:
+        # Python's hash() is salted per process, so use something stable
+        return int.from_bytes(hashlib.md5(key.encode('utf-8')).digest()[:8], 'little')
+
+    def owners(self, volumeName: str, volumeTimestep: int) -> List[int]:
+        count = len(self.pending)
+        replication = self.replicationOverrides.get(volumeName, self.replication)
+        replication = max(1, min(replication, count))
+
+        point = self.hash(f'{volumeName}-{volumeTimestep}')
+        start = bisect.bisect(self.ring, (point, count))
+
+        owners = []
+        for i in range(len(self.ring)):
+            _, index = self.ring[(start + i) % len(self.ring)]
+            if index not in owners:
+                owners.append(index)
+            if len(owners) == replication:
+                break
+
+        return owners
+
+    def wait(self, engine: Engine, future: concurrent.futures.Future) -> Any:
+        try:
+            return future.result(timeout=self.timeout)
+        except concurrent.futures.TimeoutError:
+            # Fails this and every other request pending on the engine
+            engine.fail(TimeoutError(f'No response in {self.timeout} s'))
+            return future.result()
+
+    def start(self, index: int) -> Engine:
+        engine = Engine(self.executable, self.arguments, self.protocol)
+        self.volumes = self.wait(engine, engine.submit(CatalogRequest())).volumes
+        self.preload(index, engine)
+
+        return engine
+
+    def preload(self, index: int, engine: Engine):
+        # Only the datasets this engine owns, so memory stays bounded overall
+        for name, timestep in self.volumes:
+            if index in self.owners(name, timestep):
+                engine.submit(PreloadRequest(
+                    volumeName=name,
+                    volumeTimestep=timestep,
+                ))
+
+    def reload(self) -> CatalogResponse:
+        """Has every engine read the catalog again, then preloads new datasets.
+
+        Datasets whose entry did not change stay loaded, along with
+        everything the engines have cached for them.
+        """
+
+        changed = set()
+        for index, engine in enumerate(self.engines):
+            response = self.wait(engine, engine.submit(CatalogRequest()))
+            changed |= response.changed
+            self.volumes = response.volumes
+            self.preload(index, engine)
+
+        return CatalogResponse(
+            volumes=self.volumes,
+            changed=frozenset(changed),
+        )
+
+    def restart(self, index: int, engine: Engine, e: Exception) -> Engine:
+        with self.restartLock:
+            # Every request in flight on a dead engine fails, but only the first restarts it
+            if self.engines[index] is engine:
+                print(f'Restarting engine {index}: {e!r}', file=sys.stderr)
+                engine.close()
+                self.engines[index] = self.start(index)
+
+            return self.engines[index]
+
+    def send(self, request: Any, partial: Optional[Callable[[Any], None]]=None) -> Any:
+        owners = self.owners(request.volumeName, request.volumeTimestep)
+
+        with self.pendingLock:
+            index = min(owners, key=lambda index: self.pending[index])
+            self.pending[index] += 1
+
+        try:
+            engine = self.engines[index]
+            try:
+                return self.wait(engine, engine.submit(request, partial))
+            except EngineError as e:
+                engine = self.restart(index, engine, e)
+
+            return self.wait(engine, engine.submit(request, partial))
+
+        finally:
+            with self.pendingLock:
+                self.pending[index] -= 1
+
+
+class TileCoalescer:
+    """Renders tiles of the same view that are requested together once.
+
+    The first tile of a view to arrive waits up to `window` seconds for
+    its siblings, then one frame covering the bounding box of every tile
+    that arrived is rendered and each tile gets its own region of it,
+    encoded separately by the engine. Tiles that show up after the frame
+    was sent start the next batch. Progressive renders are sent on their
+    own, since each of their responses goes straight to one client.
+    """
+
+    @dataclass
+    class Batch:
+        event: threading.Event = field(default_factory=threading.Event)
+        tiles: Dict[Tuple[int, int], List[concurrent.futures.Future]] = field(default_factory=dict)
+
+    def __init__(self, engines: EnginePool, window: float):
+        self.engines = engines
+        self.window = window
+        self.lock: threading.Lock = threading.Lock()
+        self.batches: Dict[RenderingRequest, TileCoalescer.Batch] = {}
+
+    def send(self, request: RenderingRequest, partial: Optional[Callable[[RenderingResponse], None]]=None) -> RenderingResponse:
+        tileCount = request.cameraRowCount * request.cameraColCount
+        if self.window <= 0 or tileCount == 1 or request.progressiveFrames > 1:
+            return self.engines.send(request, partial)
+
+        view = dataclasses.replace(request, cameraRowIndex=0, cameraColIndex=0)
+        tile = (request.cameraRowIndex, request.cameraColIndex)
+        future = concurrent.futures.Future()
+
+        with self.lock:
+            batch = self.batches.get(view)
+            leader = batch is None
+            if leader:
+                batch = self.batches[view] = TileCoalescer.Batch()
+
+            batch.tiles.setdefault(tile, []).append(future)
+            if len(batch.tiles) == tileCount:
+                del self.batches[view]
+                batch.event.set()
+
+        if leader:
+            batch.event.wait(self.window)
+            with self.lock:
+                if self.batches.get(view) is batch:
+                    del self.batches[view]
+
+            self.render(view, batch)
+
+        return future.result()
+
+    def render(self, view: RenderingRequest, batch: TileCoalescer.Batch):
+        tiles = list(batch.tiles)
+        rows = [row for row, _ in tiles]
+        cols = [col for _, col in tiles]
+        row0, col0 = min(rows), min(cols)
+        rowSpan = max(rows) - row0 + 1
+        colSpan = max(cols) - col0 + 1
+
+        request = dataclasses.replace(
+            view,
+            imageWidth=view.imageWidth * colSpan,
+            imageHeight=view.imageHeight * rowSpan,
+            cameraRowIndex=row0,
+            cameraRowSpan=rowSpan,
+            cameraColIndex=col0,
+            cameraColSpan=colSpan,
+            imageTiles=tuple(
+                (
+                    view.imageWidth * (col - col0),
+                    view.imageHeight * (row - row0),
+                    view.imageWidth,
+                    view.imageHeight,
+                )
+                for row, col in tiles
+            ),
+        )
+
+        try:
+            response = self.engines.send(request)
+        except Exception as e:
+            for futures in batch.tiles.values():
+                for future in futures:
+                    future.set_exception(e)
+            return
+
+        for tile, image in zip(tiles, response.images):
+            for future in batch.tiles[tile]:
+                future.set_result(RenderingResponse(
+                    renderDuration=response.renderDuration,
+                    encodeDuration=response.encodeDuration,
+                    images=(image,),
+                    complete=response.complete,
+                ))
+
+
+class ImageCache:
+    """Encoded images keyed by the quantized RenderingRequest.
+
+    Least recently used images are evicted once the cache holds more than
+    `size` bytes. With a `directory`, evicted images move to a second tier
+    on disk with its own `diskSize` budget, and are moved back into memory
+    when requested again. Files are named by a hash of the request, and
+    ones left over from an earlier run are not reused.
+    """
+
+    def __init__(self, size: int, directory: Optional[Path]=None, diskSize: int=0):
+        self.size = size
+        self.directory = directory
+        self.diskSize = diskSize
+        self.lock: threading.Lock = threading.Lock()
+        self.memory: collections.OrderedDict[RenderingRequest, bytes] = collections.OrderedDict()
+        self.memoryBytes: int = 0
+        self.disk: collections.OrderedDict[RenderingRequest, int] = collections.OrderedDict()
+        self.diskBytes: int = 0
+        self.hits: int = 0
+        self.diskHits: int = 0
+        self.misses: int = 0
+        self.evictions: int = 0
+
+        if directory is not None:
+            directory.mkdir(parents=True, exist_ok=True)
+
+    def path(self, request: RenderingRequest) -> Path:
+        return self.directory / hashlib.md5(repr(request).encode('utf-8')).hexdigest()
+
+    def get(self, request: RenderingRequest) -> Optional[bytes]:
+        with self.lock:
+            if request in self.memory:
+                self.memory.move_to_end(request)
+                self.hits += 1
+                return self.memory[request]
+
+            if request in self.disk:
+                self.diskBytes -= self.disk.pop(request)
+                try:
+                    path = self.path(request)
+                    image = path.read_bytes()
+                    path.unlink()
+                except OSError:
+                    pass
+                else:
+                    self.diskHits += 1
+                    self.insert(request, image)
+                    return image
+
+            self.misses += 1
+            return None
+
+    def put(self, request: RenderingRequest, image: bytes):
+        with self.lock:
+            if request not in self.memory:
+                self.insert(request, image)
+
+    def insert(self, request: RenderingRequest, image: bytes):
+        if len(image) > self.size:
+            return
+
+        self.memory[request] = image
+        self.memoryBytes += len(image)
+
+        while self.memoryBytes > self.size:
+            evicted, evictedImage = self.memory.popitem(last=False)
+            self.memoryBytes -= len(evictedImage)
+            self.evictions += 1
+            self.spill(evicted, evictedImage)
+
+    def spill(self, request: RenderingRequest, image: bytes):
+        if self.directory is None or len(image) > self.diskSize:
+            return
+
+        try:
+            self.path(request).write_bytes(image)
+        except OSError as e:
+            print(f'Failed to write cached image: {e!r}', file=sys.stderr)
+            return
+
+        self.disk[request] = len(image)
+        self.diskBytes += len(image)
+
+        while self.diskBytes > self.diskSize:
+            evicted, evictedSize = self.disk.popitem(last=False)
+            self.diskBytes -= evictedSize
+            self.path(evicted).unlink(missing_ok=True)
+
+    def discard(self, predicate: Callable[[RenderingRequest], bool]):
+        with self.lock:
+            for request in [request for request in self.memory if predicate(request)]:
+                self.memoryBytes -= len(self.memory.pop(request))
+
+            for request in [request for request in self.disk if predicate(request)]:
+                self.diskBytes -= self.disk.pop(request)
+                self.path(request).unlink(missing_ok=True)
+
+    def stats(self) -> Dict[str, int]:
+        with self.lock:
+            return {
+                'hits': self.hits,
+                'diskHits': self.diskHits,
+                'misses': self.misses,
+                'evictions': self.evictions,
+                'memoryImages': len(self.memory),
+                'memoryBytes': self.memoryBytes,
+                'diskImages': len(self.disk),
+                'diskBytes': self.diskBytes,
+            }
+
+
+# Largest image, in pixels along a side, that a request can make the
+# engine render, counting every tile of the view: the coalescer renders
+# the tiles that arrive together as one frame.
+MAX_IMAGE_SIZE = 8192
+
+
+def image_request(options: str) -> RenderingRequest:
+    """Parses the path of /image/, raising ValueError if it is invalid."""
 
-@app.route('/image/<path:options>', methods=['GET'])
-def image(options: str):
     options: List[str] = options.split('/')
     dataset, *options = options
     px, py, pz, *options = options
@@ -191,6 +1018,8 @@ def image(options: str):
     ux, uy, uz = map(quant, (ux, uy, uz))
     dx, dy, dz = map(quant, (dx, dy, dz))
     resolution = int(resolution)
+    if not 1 <= resolution <= MAX_IMAGE_SIZE:
+        raise ValueError(f'Resolution must be from 1 to {MAX_IMAGE_SIZE}')
 
     options: str = '/'.join(options)
     options: List[str] = options.split(',')
@@ -208,9 +1037,29 @@ def image(options: str):
         isovalues = isovalues.split('/')
     else:
         isovalues = isovalues.split('-')
-    isovalues = list(map(float, (x for x in isovalues if x != '')))
+    isovalues = tuple(map(float, (x for x in isovalues if x != '')))
     tile, ntiles = map(int, options.get('tiling', '0-1').split('-'))
+    lod = options.get('lod', '0')
+    lod = -1 if lod == 'auto' else int(lod)
+    progressive = max(1, min(2**16 - 1, int(options.get('progressive', '1'))))
+    variance = float(options.get('variance', '0'))
+    budget = int(float(options.get('budget', '0')) * 1000)  # milliseconds
+    tier = options.get('quality', 'default')
+    if tier not in QUALITY_TIERS:
+        raise ValueError(f'Unknown quality {tier!r}, expected one of {", ".join(QUALITY_TIERS)}')
+    renderer = dict(QUALITY_TIERS[tier])
+    for option, name, type in [
+        ('renderer', 'rendererType', str),
+        ('samples', 'rendererPixelSamples', int),
+        ('aosamples', 'rendererAoSamples', int),
+        ('samplingrate', 'rendererVolumeSamplingRate', float),
+        ('pathlength', 'rendererMaxPathLength', int),
+    ]:
+        if option in options:
+            renderer[name] = type(options[option])
 
+    if ntiles < 1:
+        raise ValueError('Tiling needs at least one tile')
     nrows = int(math.sqrt(ntiles))
     row = tile // nrows
 
@@ -219,48 +1068,232 @@ def image(options: str):
 
     row, nrows = map(int, options.get('row', f'{row}/{nrows}').split('/'))
     col, ncols = map(int, options.get('col', f'{col}/{ncols}').split('/'))
+    if not (0 <= row < nrows and 0 <= col < ncols):
+        raise ValueError(f'Tile {row}/{nrows}, {col}/{ncols} is outside the view')
+    if resolution * max(nrows, ncols) > MAX_IMAGE_SIZE:
+        raise ValueError(f'Resolution times tiles per side must be at most {MAX_IMAGE_SIZE}')
+    encoding, quality, *_ = options.get('encoding', 'png').split('-') + ['95']
+    if encoding.upper() not in ImageEncoding.__members__:
+        raise ValueError(f'Unknown encoding {encoding!r}, expected one of {", ".join(e.name.lower() for e in ImageEncoding)}')
+    encoding = ImageEncoding[encoding.upper()]
+    quality = max(1, min(100, int(quality)))
+
+    return RenderingRequest(
+        imageWidth=resolution,
+        imageHeight=resolution,
+        volumeName=dataset,
+        volumeTimestep=timestep,
+        colorMapName=colormap,
+        opacityMapName=opacitymap,
+        isosurfaceValues=isovalues,
+        cameraPosition=(px, py, pz),
+        cameraUp=(ux, uy, uz),
+        cameraDirection=(dx, dy, dz),
+        cameraRowIndex=row,
+        cameraRowCount=nrows,
+        cameraColIndex=col,
+        cameraColCount=ncols,
+        backgroundColor=(br, bg, bb, ba),
+        imageEncoding=encoding,
+        imageQuality=quality,
+        volumeLod=lod,
+        progressiveFrames=progressive,
+        progressiveVariance=variance,
+        **renderer,
+        frameBudget=budget,
+    )
+
+
+@app.route('/image/<path:options>', methods=['GET'])
+def image(options: str):
+    try:
+        request = image_request(options)
+    except ValueError as e:
+        # Also what int() and float() raise on a malformed number
+        return json.dumps({ 'error': str(e) }), 400, { 'Content-Type': 'application/json' }
+
+    resolution = request.imageWidth
+    encoding = request.imageEncoding
+    progressive = request.progressiveFrames
+
+    headers = {
+        'Content-Type': encoding.contentType,
+        # 'Connection': 'keep-alive',
+    }
+    if encoding == ImageEncoding.RGBA:
+        headers['X-Image-Width'] = resolution
+        headers['X-Image-Height'] = resolution
+
+    imageData = _g_cache.get(request)
+    if imageData is not None:
+        headers['Content-Length'] = len(imageData)
+        headers['X-Cache'] = 'hit'
+        return imageData, headers
+
+    if progressive > 1:
+        return progressive_response(request, headers)
+
+    beforeSend = time.time()
+
+    response = _g_coalescer.send(request)
+    if response.imageLength == 0 and volume_status(request) == LoadStatus.Ready:
+        # Either it finished loading since the render, or the world can't be
+        # built from these parameters; only the first goes away on its own
+        response = _g_coalescer.send(request)
+
+    afterSend = time.time()
 
-    beforeLock = time.time()
-
-    with _g_renderer_lock:
-        afterLock = time.time()
-
-        beforeSend = time.time()
-
-        response = _g_renderer.send(RenderingRequest(
-            imageWidth=resolution,
-            imageHeight=resolution,
-            volumeName=dataset,
-            volumeTimestep=timestep,
-            colorMapName=colormap,
-            opacityMapName=opacitymap,
-            isosurfaceValues=isovalues,
-            cameraPosition=(px, py, pz),
-            cameraUp=(ux, uy, uz),
-            cameraDirection=(dx, dy, dz),
-            cameraRowIndex=row,
-            cameraRowCount=nrows,
-            cameraColIndex=col,
-            cameraColCount=ncols,
-            backgroundColor=(br, bg, bb, ba),
-        ))
-
-        afterSend = time.time()
-
-    lockDuration = int((afterLock - beforeLock) * 1e6)
     sendDuration = int((afterSend - beforeSend) * 1e6)
 
+    if response.imageLength == 0:
+        return empty_response(request)
+
     # print(' '.join([
     #     f'Render: {response.renderDuration:>6d}',
     #     f'Encode: {response.encodeDuration:>6d}',
-    #     f'Lock: {lockDuration:>6d}',
     #     f'Send: {sendDuration:>6d}',
     # ]))
-    return response.imageData, {
-        'Content-Type': 'image/png',
-        'Content-Length': response.imageLength,
-        # 'Connection': 'keep-alive',
-    }
+    # Frames the engine lowered to keep within its frame budget are not
+    # what the request asked for
+    if response.complete:
+        _g_cache.put(request, response.imageData)
+
+    headers['Content-Length'] = response.imageLength
+    headers['X-Cache'] = 'miss'
+    return response.imageData, headers
+
+
+def volume_status(request: RenderingRequest) -> LoadStatus:
+    return _g_engines.send(StatusRequest(
+        volumeName=request.volumeName,
+        volumeTimestep=request.volumeTimestep,
+    ))
+
+
+def empty_response(request: RenderingRequest):
+    status = volume_status(request)
+
+    if status == LoadStatus.Ready:
+        # The volume is there, so the request itself is at fault: an unknown
+        # colormap or opacitymap, or a region outside the image. Retrying
+        # would never help.
+        body = {
+            'status': status.name.lower(),
+            'error': 'Could not render the volume with these parameters',
+        }
+        return json.dumps(body), 400, { 'Content-Type': 'application/json' }
+
+    return status_response(status)
+
+
+PROGRESSIVE_BOUNDARY = 'tapestry-frame'
+
+
+def progressive_response(request: RenderingRequest, headers: Dict[str, Any]):
+    """Streams each refined image as it arrives, as multipart/x-mixed-replace.
+
+    Browsers show every part of such a response in turn in an <img>, so the
+    first, noisy image appears as soon as it is rendered. Only the final
+    image is cached.
+    """
+
+    frames: queue.Queue = queue.Queue()
+
+    def render():
+        try:
+            frames.put(_g_coalescer.send(request, frames.put))
+        except Exception as e:
+            frames.put(e)
+
+    threading.Thread(target=render, daemon=True).start()
+
+    def next_frame() -> RenderingResponse:
+        response = frames.get()
+        if isinstance(response, Exception):
+            raise response
+        return response
+
+    response = next_frame()
+    if response.imageLength == 0:
+        # Nothing follows an empty image, the render was skipped
+        return empty_response(request)
+
+    contentType = headers.pop('Content-Type')
+
+    def stream(response: RenderingResponse):
+        while True:
+            part = [
+                f'--{PROGRESSIVE_BOUNDARY}',
+                f'Content-Type: {contentType}',
+                f'Content-Length: {response.imageLength}',
+                f'X-Frame: {response.frame}',
+                '', '',
+            ]
+            yield '\r\n'.join(part).encode('utf-8') + response.imageData + b'\r\n'
+
+            if response.last:
+                # An interrupted render stops early at lower quality
+                if response.complete:
+                    _g_cache.put(request, response.imageData)
+                break
+
+            response = next_frame()
+
+        yield f'--{PROGRESSIVE_BOUNDARY}--\r\n'.encode('utf-8')
+
+    headers['Content-Type'] = f'multipart/x-mixed-replace; boundary={PROGRESSIVE_BOUNDARY}'
+    headers['X-Cache'] = 'miss'
+    return Response(stream(response), headers=headers)
+
+
+def status_response(status: LoadStatus):
+    code = {
+        LoadStatus.Unknown: 404,
+        LoadStatus.Unloaded: 503,
+        LoadStatus.Loading: 503,
+        LoadStatus.Ready: 200,
+        LoadStatus.Failed: 500,
+    }[status]
+
+    headers = { 'Content-Type': 'application/json' }
+    if code == 503:
+        headers['Retry-After'] = '1'
+
+    return json.dumps({ 'status': status.name.lower() }), code, headers
+
+
+@app.route('/status/<dataset>/<int:timestep>', methods=['GET'])
+def status(dataset: str, timestep: int):
+    status = _g_engines.send(StatusRequest(
+        volumeName=dataset,
+        volumeTimestep=timestep,
+    ))
+
+    return status_response(status)
+
+
+@app.route('/catalog', methods=['GET'])
+def catalog():
+    return json.dumps(_g_engines.volumes), { 'Content-Type': 'application/json' }
+
+
+@app.route('/catalog/reload', methods=['POST'])
+def reload_catalog():
+    response = _g_engines.reload()
+
+    # Images of datasets that changed or went away no longer match
+    unchanged = set(response.volumes) - response.changed
+    _g_cache.discard(lambda request: (request.volumeName, request.volumeTimestep) not in unchanged)
+
+    return json.dumps({
+        'volumes': response.volumes,
+        'changed': sorted(response.changed),
+    }), { 'Content-Type': 'application/json' }
+
+
+@app.route('/cache', methods=['GET'])
+def cache():
+    return json.dumps(_g_cache.stats()), { 'Content-Type': 'application/json' }
 
 
 @app.route('/')
@@ -276,59 +1309,48 @@ def index():
     return html, { 'Content-Type': 'text/html' }
 
 
-def main(engineExecutable: Path, bind: str, port: int, debug: bool, logEngineInput: bool):
+def main(
+    engineExecutable: Path,
+    engineArguments: List[str],
+    engineProtocol: str,
+    engineCount: int,
+    replication: int,
+    replicationOverrides: List[Tuple[str, int]],
+    engineTimeout: float,
+    coalesceWindow: float,
+    cacheSize: int,
+    cacheDirectory: Optional[Path],
+    cacheDiskSize: int,
+    bind: str,
+    port: int,
+    debug: bool,
+    logEngineInput: bool,
+):
     global _g_extra_fileobj
     if logEngineInput:
         _g_extra_fileobj = open('tmp/engine.stdin.txt', 'wb')
         import atexit; atexit.register(_g_extra_fileobj.close)
 
-    renderer = make_renderer(engineExecutable)
-    next(renderer)
-
-    request = RenderingRequest(
-        imageWidth=256,
-        imageHeight=256,
-        volumeName=None,
-        volumeTimestep=None,
-        colorMapName='spectralReverse',
-        opacityMapName='reverseRamp',
-        isosurfaceValues=[],
-        cameraPosition=(quant(1.0), quant(0.0), quant(1.0)),
-        cameraUp=(quant(0.0), quant(1.0), quant(0.0)),
-        cameraDirection=(quant(-1.0), quant(0.0), quant(-1.0)),
-        cameraRowIndex=0,
-        cameraRowCount=1,
-        cameraColIndex=0,
-        cameraColCount=1,
-        backgroundColor=(0, 0, 0, 0),
+    global _g_engines
+    _g_engines = EnginePool(
+        engineExecutable,
+        engineArguments,
+        engineProtocol,
+        engineCount,
+        replication,
+        dict(replicationOverrides),
+        engineTimeout,
     )
 
-    for name, timestep in [
-        ('supernova', 0),
-        ('magnetic', 0),
-        ('teapot', 0),
-        ('tornado', 0),
-        ('turbine', 0),
-        ('turbulence', 0),
-    ] + [
-        ('jet', timestep)
-        for timestep in range(19)
-    ]:
-        print(f'Loading {name} ({timestep})...', file=sys.stderr, flush=True, end='')
-        start = time.time()
-        
-        renderer.send(dataclasses.replace(
-            request,
-            volumeName=name,
-            volumeTimestep=timestep,
-        ))
-
-        duration = time.time() - start
-
-        print(f' Done {duration:>,.3f}s')
+    global _g_coalescer
+    _g_coalescer = TileCoalescer(_g_engines, coalesceWindow / 1000.0)
 
-    global _g_renderer
-    _g_renderer = renderer
+    global _g_cache
+    _g_cache = ImageCache(
+        cacheSize * 2**20,
+        cacheDirectory,
+        cacheDiskSize * 2**20,
+    )
 
     app.run(
         host=bind,
@@ -347,6 +1369,76 @@ def cli(args: Optional[List[str]]=None):
         type=Path,
         default=Path('tapestryEngine'),
     )
+    parser.add_argument(
+        '--engine-argument',
+        dest='engineArguments',
+        action='append',
+        default=[],
+        help='Extra argument for the engine, e.g. --engine-argument=--load --engine-argument=mmap',
+    )
+    parser.add_argument(
+        '--engine-protocol',
+        dest='engineProtocol',
+        choices=['binary', 'text'],
+        default='binary',
+        help='Use text to make the engine input human readable for debugging',
+    )
+    parser.add_argument(
+        '--engines',
+        dest='engineCount',
+        type=int,
+        default=1,
+        help='Number of engine processes rendering in parallel',
+    )
+    parser.add_argument(
+        '--replication',
+        type=int,
+        default=1,
+        help='Number of engines that hold each dataset',
+    )
+    parser.add_argument(
+        '--replicate',
+        dest='replicationOverrides',
+        type=lambda s: (s.split('=')[0], int(s.split('=')[1])),
+        action='append',
+        default=[],
+        help='Replication for a hot dataset, e.g. --replicate teapot=4',
+    )
+    parser.add_argument(
+        '--engine-timeout',
+        dest='engineTimeout',
+        type=float,
+        default=60.0,
+        help='Seconds to wait for an engine to answer before restarting it',
+    )
+    parser.add_argument(
+        '--coalesce-window',
+        dest='coalesceWindow',
+        type=float,
+        default=5.0,
+        help='Milliseconds to wait for the other tiles of a view so they render as one frame, 0 to disable',
+    )
+    parser.add_argument(
+        '--cache-size',
+        dest='cacheSize',
+        type=int,
+        default=256,
+        help='MiB of encoded images kept in memory, 0 to disable the cache',
+    )
+    parser.add_argument(
+        '--cache-directory',
+        dest='cacheDirectory',
+        type=Path,
+        default=None,
+        help='Keep images evicted from memory in this directory',
+    )
+    parser.add_argument(
+        '--cache-disk-size',
+        dest='cacheDiskSize',
+        type=int,
+        default=4096,
+        help='MiB of encoded images kept in --cache-directory',
+    )
     parser.add_argument('--bind', default='0.0.0.0')
     parser.add_argument('--port', default=8080, type=int)
     parser.add_argument('--debug', action='store_true')
@@ -360,5 +1452,28 @@ if __name__ == '__main__':
     cli()
 
 if __name__ == 'wsgi':
-    _g_renderer = make_renderer(os.environ['ENGINE_EXECUTABLE'])
-    next(_g_renderer)
+    _g_engines = EnginePool(
+        os.environ['ENGINE_EXECUTABLE'],
+        shlex.split(os.environ.get('ENGINE_ARGUMENTS', '')),
+        os.environ.get('ENGINE_PROTOCOL', 'binary'),
+        int(os.environ.get('ENGINE_COUNT', '1')),
+        int(os.environ.get('ENGINE_REPLICATION', '1')),
+        {
+            name: int(replication)
+            for name, replication in (
+                x.split('=')
+                for x in os.environ.get('ENGINE_REPLICATE', '').split(',')
+                if x != ''
+            )
+        },
+        float(os.environ.get('ENGINE_TIMEOUT', '60')),
+    )
+    _g_coalescer = TileCoalescer(
+        _g_engines,
+        float(os.environ.get('COALESCE_WINDOW', '5')) / 1000.0,
+    )
+    _g_cache = ImageCache(
+        int(os.environ.get('CACHE_SIZE', '256')) * 2**20,
+        Path(os.environ['CACHE_DIRECTORY']) if 'CACHE_DIRECTORY' in os.environ else None,
+        int(os.environ.get('CACHE_DISK_SIZE', '4096')) * 2**20,
+    )
@@ -0,0 +1,84 @@
+"""
+Split a float32 raw volume into bricks that the engine pages in on demand.
+
+Each brick also holds the first layer of its neighbours on the high side,
+so adjacent bricks interpolate across their shared faces. Bricks start on
+page boundaries, so reading one never touches another.
+"""
+
+from __future__ import annotations
+from pathlib import Path
+from typing import Optional
+import struct
+
+import numpy as np
+
+
+MAGIC = b'TAPB'
+VERSION = 1
+PAGE = 4096
+
+HEADER = struct.Struct('<4sI3ii3iIdQ')
+ENTRY = struct.Struct('<Q3i3iff')
+
+
+def align(offset: int) -> int:
+    return (offset + PAGE - 1) // PAGE * PAGE
+
+
+def main(inp: Path, out: Optional[Path], dimensions: tuple[int, int, int], brick_size: int):
+    d1, d2, d3 = dimensions
+    data = np.fromfile(inp, dtype=np.float32).reshape((d3, d2, d1))
+
+    counts = [(d + brick_size - 1) // brick_size for d in dimensions]
+    n1, n2, n3 = counts
+
+    if out is None:
+        out = inp.with_suffix('.bricks')
+
+    entries = []
+    offset = align(HEADER.size + n1 * n2 * n3 * ENTRY.size)
+    for k in range(n3):
+        for j in range(n2):
+            for i in range(n1):
+                x0, y0, z0 = i * brick_size, j * brick_size, k * brick_size
+                x1 = min(x0 + brick_size + 1, d1)
+                y1 = min(y0 + brick_size + 1, d2)
+                z1 = min(z0 + brick_size + 1, d3)
+
+                brick = data[z0:z1, y0:y1, x0:x1]
+                entries.append((offset, (x0, y0, z0), (x1 - x0, y1 - y0, z1 - z0), brick))
+                offset = align(offset + brick.nbytes)
+
+    mean = float(np.nanmean(data, dtype=np.float64))
+
+    print(f'Writing {n1}x{n2}x{n3} bricks of {brick_size} to {out}')
+
+    with open(out, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, d1, d2, d3, brick_size, n1, n2, n3, 0, mean, HEADER.size))
+
+        for offset, origin, size, brick in entries:
+            lo = float(np.nanmin(brick))
+            hi = float(np.nanmax(brick))
+            f.write(ENTRY.pack(offset, *origin, *size, lo, hi))
+
+        for offset, origin, size, brick in entries:
+            f.seek(offset)
+            np.ascontiguousarray(brick).tofile(f)
+
+
+def cli():
+    import argparse
+
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--input', '-i', dest='inp', type=Path, required=True)
+    parser.add_argument('--output', '-o', dest='out', type=Path, default=None)
+    parser.add_argument('--dimensions', type=int, nargs=3, required=True, metavar=('X', 'Y', 'Z'))
+    parser.add_argument('--brick-size', type=int, default=64)
+    args = vars(parser.parse_args())
+
+    main(**args)
+
+
+if __name__ == '__main__':
+    cli()